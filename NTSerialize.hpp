@@ -52,6 +52,34 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <cstring>
+#include <vector>
+#include <tuple>
+#include <utility>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <limits>
+#if defined( __unix__ ) || defined( __APPLE__ )
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+#if defined( __linux__ )
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <chrono>
+#include <cstdint>
 
 namespace ntllct {
 
@@ -60,28 +88,933 @@ enum class ntsdirective : unsigned char {
 	posstart,	// IO pointer to start
 	posend,		// IO pointer to end
 	debug,		// Enable debug mode
-	nodebug		// Disable debug mode
+	nodebug,	// Disable debug mode
+	metrics,	// Reset and enable metrics
+	nometrics,	// Disable metrics
+	zerocopy,	// Reference large strings and vectors instead of copying
+	nozerocopy,	// Copy everything into internal buffer
+	dedup,		// Write repeated strings as back-references
+	nodedup,	// Write every string in full
+	packkeys,	// Delta and bit-pack integral keys of ordered containers
+	nopackkeys,	// Write ordered keys at full width
+	floatxor,	// XOR-compress vectors and deques of floats and doubles
+	nofloatxor,	// Write floating-point sequences as raw values
+	rle,		// Run-length encode vectors and arrays of raw types
+	norle,		// Write vectors and arrays of raw types as they are
+	flat,		// Nested vectors and strings as offsets and one payload
+	noflat		// Prefix every nested vector and string with its length
 };
 
+enum class ntstype : unsigned char {
+	scalar,		// Top-level fundamentals and raw classes
+	string,
+	vector,
+	deque,
+	forward_list,
+	list,
+	queue,
+	priority_queue,
+	stack,
+	array,
+	set,
+	multiset,
+	unordered_set,
+	unordered_multiset,
+	map,
+	multimap,
+	unordered_map,
+	unordered_multimap,
+	pointer,	// shared_ptr and unique_ptr
+	count
+};
+
+// Per-type counters, IO is attributed to the innermost container
+struct ntscounters {
+	uint64_t calls{0};
+	uint64_t elements{0};
+	uint64_t bytes_written{0};
+	uint64_t bytes_read{0};
+};
+
+// Snapshot of the NTSerialize metrics
+struct ntsmetrics {
+	std::array<ntscounters, static_cast<size_t>( ntstype::count )> types;
+	uint64_t bytes_written{0};
+	uint64_t bytes_read{0};
+	uint64_t buffer_size{0};	// Bytes written since the last clear
+	uint64_t buffer_growths{0};	// Times the buffer outgrew its capacity
+	// log2 histograms of save()/load() latency in microseconds
+	std::array<uint64_t, 32> save_us{};
+	std::array<uint64_t, 32> load_us{};
+	
+	const ntscounters& operator[]( const ntstype type ) const {
+		return( types[static_cast<size_t>( type )] );
+	}
+};
+
+// Why decoding stopped, the first error is kept until clear()
+enum class ntserror {
+	none,
+	truncated,	// A value or length runs past the end of the data
+	corrupt,	// Invalid reference, id, mode or column layout
+	elements,	// A container longer than ntslimits::max_elements
+	bytes,		// Decoded elements over ntslimits::max_bytes
+	depth		// Values nested deeper than ntslimits::max_depth
+};
+
+// Decode budget. Lengths are also always checked against the bytes
+// left in the buffer before anything is allocated for them.
+struct ntslimits {
+	size_t max_bytes{SIZE_MAX};		// Total size of decoded elements
+	size_t max_elements{SIZE_MAX};	// Elements in one container
+	size_t max_depth{SIZE_MAX};		// Nested containers and pointers
+};
+
+// Capacity of a stream buffer's put area, read through the protected
+// accessors. A string buffer's put area spans its string's capacity.
+struct ntsputarea : std::streambuf {
+	static size_t capacity( const std::streambuf& buffer ) {
+		char* ( std::streambuf::*begin_ )() const = &ntsputarea::pbase;
+		char* ( std::streambuf::*end_ )() const = &ntsputarea::epptr;
+		return( static_cast<size_t>(
+					( buffer.*end_ )() - ( buffer.*begin_ )() ) );
+	}
+};
+
+// Thread-local pool of string streams. Constructing a stringstream and
+// its locale for every small message dominates RPC-style workloads, so
+// NTSerialize borrows one here and returns it with its storage intact.
+class NTSBufferPool {
+public:
+	static const size_t max_streams = 16;			// Kept per thread
+	static const size_t max_bytes = 1024 * 1024;	// Larger are freed
+	
+	static std::unique_ptr<std::stringstream> acquire() {
+		if( _state() == _destroyed || _local().streams.empty() )
+			return( std::unique_ptr<std::stringstream>(
+											new std::stringstream ) );
+		std::vector<std::unique_ptr<std::stringstream>>& streams_ =
+			_local().streams;
+		std::unique_ptr<std::stringstream> stream_ =
+			std::move( streams_.back() );
+		streams_.pop_back();
+		return( stream_ );
+	}
+	static void release( std::unique_ptr<std::stringstream> stream ) {
+		if( !stream || _state() == _destroyed )
+			return;
+		std::vector<std::unique_ptr<std::stringstream>>& streams_ =
+			_local().streams;
+		// The storage kept is what counts: a stream cleared after a
+		// large message is empty but still holds its capacity
+		std::streamoff size_ = stream->rdbuf()->pubseekoff(
+									0, std::ios::end, std::ios::out );
+		if( streams_.size() >= max_streams || size_ < 0
+			|| static_cast<size_t>( size_ ) > max_bytes
+			|| ntsputarea::capacity( *stream->rdbuf() ) > max_bytes )
+			return;
+		// str() assigns, the grown string keeps its capacity
+		stream->clear();
+		stream->str( std::string() );
+		streams_.push_back( std::move( stream ) );
+	}
+	// Streams pooled by the calling thread
+	static size_t size() {
+		return( _state() == _destroyed ? 0 : _local().streams.size() );
+	}
+
+private:
+	enum : unsigned char { _unused, _alive, _destroyed };
+	struct _pool {
+		std::vector<std::unique_ptr<std::stringstream>> streams;
+		_pool() {
+			_state() = _alive;
+		}
+		~_pool() {
+			_state() = _destroyed;
+		}
+	};
+	static _pool& _local() {
+		static thread_local _pool pool_;
+		return( pool_ );
+	}
+	// Streams may be returned after the thread-local pool was destroyed
+	static unsigned char& _state() {
+		static thread_local unsigned char state_ = _unused;
+		return( state_ );
+	}
+}; // class NTSBufferPool
+
+class NTSerialize;
+template<typename T> class ntslazy;
+template<typename T> class ntsflat;
+
+// True if T brings its own operator>> for NTSerialize
+template<typename T, typename = void>
+struct ntsuserread : std::false_type {};
+template<typename T>
+struct ntsuserread<T, decltype( void( operator>>(
+							std::declval<NTSerialize&>(),
+							std::declval<T&>() ) ) )> : std::true_type {};
+
+// Encoded size of T when it doesn't depend on the value, 0 otherwise
+template<typename T>
+struct ntsfixed : std::integral_constant<size_t,
+	std::is_fundamental<T>::value
+	|| ( std::is_class<T>::value && !ntsuserread<T>::value )
+	? sizeof( T ) : 0> {};
+template<typename T, size_t N>
+struct ntsfixed<std::array<T, N>>
+	: std::integral_constant<size_t, ntsfixed<T>::value * N> {};
+template<typename T, size_t N>
+struct ntsfixed<T[N]>
+	: std::integral_constant<size_t, ntsfixed<T>::value * N> {};
+template<typename T1, typename T2>
+struct ntsfixed<std::pair<T1, T2>> : std::integral_constant<size_t,
+	ntsfixed<T1>::value != 0 && ntsfixed<T2>::value != 0
+	? ntsfixed<T1>::value + ntsfixed<T2>::value : 0> {};
+template<typename T>
+struct ntsfixed<ntslazy<T>> : std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<ntsflat<T>> : std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<std::shared_ptr<T>> : std::integral_constant<size_t, 0> {};
+template<typename T, typename D>
+struct ntsfixed<std::unique_ptr<T, D>>
+	: std::integral_constant<size_t, 0> {};
+template<>
+struct ntsfixed<std::string> : std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<std::vector<T>> : std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<std::deque<T>> : std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<std::forward_list<T>>
+	: std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<std::list<T>> : std::integral_constant<size_t, 0> {};
+template<typename T, typename C>
+struct ntsfixed<std::queue<T, C>> : std::integral_constant<size_t, 0> {};
+template<typename T, typename C, typename P>
+struct ntsfixed<std::priority_queue<T, C, P>>
+	: std::integral_constant<size_t, 0> {};
+template<typename T, typename C>
+struct ntsfixed<std::stack<T, C>> : std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<std::set<T>> : std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<std::multiset<T>> : std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<std::unordered_set<T>>
+	: std::integral_constant<size_t, 0> {};
+template<typename T>
+struct ntsfixed<std::unordered_multiset<T>>
+	: std::integral_constant<size_t, 0> {};
+template<typename T1, typename T2>
+struct ntsfixed<std::map<T1, T2>> : std::integral_constant<size_t, 0> {};
+template<typename T1, typename T2>
+struct ntsfixed<std::multimap<T1, T2>>
+	: std::integral_constant<size_t, 0> {};
+template<typename T1, typename T2>
+struct ntsfixed<std::unordered_map<T1, T2>>
+	: std::integral_constant<size_t, 0> {};
+template<typename T1, typename T2>
+struct ntsfixed<std::unordered_multimap<T1, T2>>
+	: std::integral_constant<size_t, 0> {};
+
+// True if a sequence of T is encoded as its raw memory
+template<typename T>
+struct ntsbulk : std::integral_constant<bool,
+	ntsfixed<T>::value == sizeof( T )
+	&& std::is_trivially_copyable<T>::value> {};
+
+// Smallest encoding of T. Types with size() are prefixed with it unless
+// they bring their own operator>>, anything else takes at least a byte.
+template<typename T, typename = void>
+struct ntsminsize : std::integral_constant<size_t,
+	ntsfixed<T>::value != 0 ? ntsfixed<T>::value : 1> {};
+template<typename T>
+struct ntsminsize<T, decltype( void( std::declval<const T&>().size() ) )>
+	: std::integral_constant<size_t,
+		ntsfixed<T>::value != 0 ? ntsfixed<T>::value
+		: ntsuserread<T>::value ? 1 : sizeof( size_t )> {};
+template<typename T>
+struct ntsminsize<std::forward_list<T>>
+	: std::integral_constant<size_t, sizeof( size_t )> {};
+template<typename T1, typename T2>
+struct ntsminsize<std::pair<T1, T2>> : std::integral_constant<size_t,
+	ntsminsize<T1>::value + ntsminsize<T2>::value> {};
+
+// True if T holds arrays, which are not fixed-size in rle mode
+template<typename T>
+struct ntsarray : std::false_type {};
+template<typename T, size_t N>
+struct ntsarray<std::array<T, N>> : std::true_type {};
+template<typename T, size_t N>
+struct ntsarray<T[N]> : std::true_type {};
+template<typename T1, typename T2>
+struct ntsarray<std::pair<T1, T2>> : std::integral_constant<bool,
+	ntsarray<T1>::value || ntsarray<T2>::value> {};
+
+// True for keys that packkeys mode delta and bit-packs
+template<typename T>
+struct ntspacked : std::integral_constant<bool,
+	std::is_integral<T>::value && !std::is_same<T, bool>::value> {};
+
+// True for the inner containers flat mode stores in one payload, type
+// is their raw element
+template<typename T>
+struct ntsflatten : std::false_type {};
+template<typename T>
+struct ntsflatten<std::vector<T>> : ntsbulk<T> {
+	typedef T type;
+};
+template<>
+struct ntsflatten<std::vector<bool>> : std::false_type {};
+template<>
+struct ntsflatten<std::string> : std::true_type {
+	typedef char type;
+};
+
+// True for the floating-point types floatxor mode compresses
+template<typename T>
+struct ntsxor : std::integral_constant<bool,
+	std::is_floating_point<T>::value
+	&& ( sizeof( T ) == 4 || sizeof( T ) == 8 )> {};
+
+// Field accessors of S for the columnar encoding of std::vector<S>
+template<typename S, typename... F>
+class ntscolumns {
+public:
+	template<size_t I>
+	using field = typename std::tuple_element<I, std::tuple<F...>>::type;
+	
+	ntscolumns( F S::*... fields ) : _fields( fields... ) {
+		
+	}
+	const std::tuple<F S::*...>& fields() const {
+		return( _fields );
+	}
+
+private:
+	std::tuple<F S::*...> _fields;
+}; // class ntscolumns
+
+template<typename S, typename... F>
+ntscolumns<S, F...> make_ntscolumns( F S::*... fields ) {
+	return( ntscolumns<S, F...>( fields... ) );
+}
+
+// Stream buffer over memory owned by the caller, for encoding into and
+// decoding from it in place. Writes past the capacity fail, reads see
+// everything given as valid or written so far.
+class ntsmembuf : public std::streambuf {
+public:
+	void reset( char* data, const size_t capacity, const size_t size ) {
+		_end = data + size;
+		setp( data, data + capacity );
+		setg( data, data, _end );
+	}
+	char* data() const {
+		return( eback() );
+	}
+	// Valid bytes, the furthest of the initial size and the writes
+	size_t size() {
+		_sync();
+		return( static_cast<size_t>( _end - eback() ) );
+	}
+	
+	ntsmembuf() {
+		
+	}
+	ntsmembuf( char* data, const size_t capacity, const size_t size ) {
+		reset( data, capacity, size );
+	}
+
+protected:
+	int_type underflow() override {
+		_sync();
+		if( gptr() < egptr() )
+			return( traits_type::to_int_type( *gptr() ) );
+		return( traits_type::eof() );
+	}
+	std::streamsize showmanyc() override {
+		_sync();
+		return( gptr() < egptr() ? egptr() - gptr() : -1 );
+	}
+	pos_type seekoff( off_type off, std::ios_base::seekdir dir,
+					  std::ios_base::openmode which ) override {
+		_sync();
+		const bool in_ = ( which & std::ios_base::in ) != 0;
+		const bool out_ = ( which & std::ios_base::out ) != 0;
+		off_type pos_ = off;
+		if( dir == std::ios_base::cur ) {
+			if( in_ == out_ )
+				return( pos_type( off_type( -1 ) ) );
+			pos_ += in_ ? gptr() - eback() : pptr() - pbase();
+		} else if( dir == std::ios_base::end ) {
+			pos_ += _end - eback();
+		}
+		if( ( !in_ && !out_ ) || pos_ < 0
+			|| ( in_ && pos_ > _end - eback() )
+			|| ( out_ && pos_ > epptr() - pbase() ) ) {
+			return( pos_type( off_type( -1 ) ) );
+		}
+		if( in_ )
+			setg( eback(), eback() + pos_, _end );
+		if( out_ ) {
+			setp( pbase(), epptr() );
+			for( off_type left_ = pos_; left_ > 0; ) {
+				int step_ = left_ > INT_MAX ? INT_MAX
+							: static_cast<int>( left_ );
+				pbump( step_ );
+				left_ -= step_;
+			}
+		}
+		return( pos_type( pos_ ) );
+	}
+	pos_type seekpos( pos_type pos, std::ios_base::openmode which )
+		override {
+		return( seekoff( off_type( pos ), std::ios_base::beg, which ) );
+	}
+
+private:
+	// Let reads see what was written
+	void _sync() {
+		if( pptr() > _end )
+			_end = pptr();
+		setg( eback(), gptr(), _end );
+	}
+	
+	char* _end{nullptr};
+}; // class ntsmembuf
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+enum class ntspages : unsigned char {
+	normal,			// Base pages
+	transparent,	// Ask for 2 MB pages with madvise(), base pages if not
+	hugetlb			// Reserved 2 MB pages, growth fails without them
+};
+
+enum class ntsplacement : unsigned char {
+	any,			// Node of the first touch
+	local,			// Node of the thread that touches it
+	interleave		// Page by page over all allowed nodes
+};
+
+// Growable stream buffer for multi-GB images. The address space is
+// reserved once and memory is mapped at its end as the data grows, so
+// nothing is ever copied or moved. Linux places the pages on NUMA
+// nodes as asked.
+class ntshugebuf : public ntsmembuf {
+public:
+	static const size_t huge_page = 2 << 20;
+	
+	bool reserve( const size_t max_size,
+				  const ntspages pages = ntspages::transparent,
+				  const ntsplacement placement = ntsplacement::any ) {
+		release();
+		const size_t size_ = _round( max_size );
+		int flags_ = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined( MAP_NORESERVE )
+		flags_ |= MAP_NORESERVE;
+#endif
+		void* map_ = ::mmap( nullptr, size_ + huge_page, PROT_NONE, flags_,
+							 -1, 0 );
+		if( map_ == MAP_FAILED )
+			return( false );
+		// Start on a huge page boundary, give the rest back
+		char* base_ = static_cast<char*>( map_ );
+		const size_t head_ = ( huge_page - reinterpret_cast<uintptr_t>(
+			base_ ) % huge_page ) % huge_page;
+		if( head_ != 0 )
+			::munmap( base_, head_ );
+		::munmap( base_ + head_ + size_, huge_page - head_ );
+		_base = base_ + head_;
+		_reserved = size_;
+		_pages = pages;
+		_placement = placement;
+		reset( _base, 0, 0 );
+		return( true );
+	}
+	void release() {
+		if( _base != nullptr )
+			::munmap( _base, _reserved );
+		_base = nullptr;
+		_reserved = 0;
+		_committed = 0;
+		_placed = true;
+		reset( nullptr, 0, 0 );
+	}
+	// Start over, keeping the mapped memory
+	void clear() {
+		reset( _base, _committed, 0 );
+	}
+	// Mapped and reserved bytes
+	size_t capacity() const {
+		return( _committed );
+	}
+	size_t reserved() const {
+		return( _reserved );
+	}
+	// False once the kernel refused the NUMA placement
+	bool placed() const {
+		return( _placed );
+	}
+	
+	ntshugebuf() {
+		
+	}
+	~ntshugebuf() {
+		release();
+	}
+
+protected:
+	int_type overflow( int_type c ) override {
+		if( traits_type::eq_int_type( c, traits_type::eof() ) )
+			return( traits_type::not_eof( c ) );
+		if( !_grow( _committed + 1 ) )
+			return( traits_type::eof() );
+		*pptr() = traits_type::to_char_type( c );
+		pbump( 1 );
+		return( c );
+	}
+
+private:
+	static size_t _round( const size_t size ) {
+		return( ( size + huge_page - 1 ) / huge_page * huge_page );
+	}
+	// Map at least need bytes, doubling what is mapped
+	bool _grow( const size_t need ) {
+		if( _base == nullptr || need > _reserved )
+			return( false );
+		const size_t next_ = std::min( _reserved,
+			_round( std::max( need, _committed * 2 ) ) );
+		char* at_ = _base + _committed;
+		const size_t size_ = next_ - _committed;
+		bool ok_ = true;
+		if( _pages == ntspages::hugetlb ) {
+#if defined( MAP_HUGETLB )
+			const int flags_ = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+			ok_ = ::mmap( at_, size_, PROT_READ | PROT_WRITE,
+						  flags_ | MAP_HUGETLB, -1, 0 ) != MAP_FAILED;
+			// Keep the range reserved if the pages weren't there
+			if( !ok_ )
+				::mmap( at_, size_, PROT_NONE, flags_, -1, 0 );
+#else
+			ok_ = false;
+#endif
+		} else {
+			ok_ = ::mprotect( at_, size_, PROT_READ | PROT_WRITE ) == 0;
+#if defined( MADV_HUGEPAGE )
+			if( ok_ && _pages == ntspages::transparent )
+				::madvise( at_, size_, MADV_HUGEPAGE );
+#endif
+		}
+		if( !ok_ )
+			return( false );
+		_place( at_, size_ );
+		// Same memory, just more of it
+		const off_type get_ = gptr() - eback();
+		const off_type put_ = pptr() - pbase();
+		reset( _base, next_, size() );
+		ntsmembuf::seekpos( pos_type( put_ ), std::ios_base::out );
+		ntsmembuf::seekpos( pos_type( get_ ), std::ios_base::in );
+		_committed = next_;
+		return( true );
+	}
+	void _place( char* data, const size_t size ) {
+#if defined( __linux__ )
+		// Policies of <linux/mempolicy.h>
+		enum { mpol_interleave = 3, mpol_local = 4, mems_allowed = 4 };
+		if( _placement == ntsplacement::any )
+			return;
+		unsigned long nodes_[16] = {};
+		const unsigned long max_ = sizeof( nodes_ ) * CHAR_BIT;
+		long error_ = 0;
+		if( _placement == ntsplacement::local ) {
+			error_ = ::syscall( SYS_mbind, data, size, mpol_local,
+								nullptr, 0, 0 );
+		} else {
+			error_ = ::syscall( SYS_get_mempolicy, nullptr, nodes_, max_,
+								nullptr, 0, mems_allowed );
+			if( error_ == 0 )
+				error_ = ::syscall( SYS_mbind, data, size,
+									mpol_interleave, nodes_, max_, 0 );
+		}
+		_placed = _placed && error_ == 0;
+#else
+		(void)data;
+		(void)size;
+		_placed = _placement == ntsplacement::any;
+#endif
+	}
+	
+	char*			_base{nullptr};
+	size_t			_reserved{0};
+	size_t			_committed{0};
+	ntspages		_pages{ntspages::normal};
+	ntsplacement	_placement{ntsplacement::any};
+	bool			_placed{true};
+}; // class ntshugebuf
+#endif
+
+// Immutable encoded data shared by any number of reader cursors, see
+// the NTSerialize cursor constructor. Copies share the bytes.
+class ntsimage {
+public:
+	// Read a whole file into memory
+	bool load( const char* filename ) {
+		std::ifstream ifs_( filename, std::ios::in | std::ios::binary
+									  | std::ios::ate );
+		if( !ifs_.is_open() )
+			return( false );
+		std::streamoff size_ = ifs_.tellg();
+		if( size_ < 0 )
+			return( false );
+		std::shared_ptr<std::string> data_ = std::make_shared<std::string>(
+			static_cast<size_t>( size_ ), '\0' );
+		ifs_.seekg( 0 );
+		if( !ifs_.read( &( *data_ )[0], size_ ) )
+			return( false );
+		_data = std::shared_ptr<const char>( data_, data_->data() );
+		_size = data_->size();
+		return( true );
+	}
+#if defined( __unix__ ) || defined( __APPLE__ )
+	// Map a file read-only, pages are loaded as cursors touch them
+	bool map( const char* filename ) {
+		int fd_ = ::open( filename, O_RDONLY );
+		if( fd_ < 0 )
+			return( false );
+		struct stat stat_;
+		bool ok_ = ::fstat( fd_, &stat_ ) == 0;
+		const size_t size_ = ok_ ? static_cast<size_t>( stat_.st_size ) : 0;
+		void* map_ = MAP_FAILED;
+		if( size_ != 0 )
+			map_ = ::mmap( nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0 );
+		::close( fd_ );
+		if( !ok_ || ( size_ != 0 && map_ == MAP_FAILED ) )
+			return( false );
+		_data.reset();
+		if( size_ != 0 ) {
+			_data = std::shared_ptr<const char>(
+				static_cast<const char*>( map_ ),
+				[size_]( const char* data ) {
+					::munmap( const_cast<char*>( data ), size_ );
+				} );
+		}
+		_size = size_;
+		return( true );
+	}
+#endif
+	const char* data() const {
+		return( _data.get() );
+	}
+	size_t size() const {
+		return( _size );
+	}
+	bool empty() const {
+		return( _size == 0 );
+	}
+	
+	ntsimage() {
+		
+	}
+	// Takes over the string
+	explicit ntsimage( std::string data ) {
+		std::shared_ptr<std::string> data_ =
+			std::make_shared<std::string>( std::move( data ) );
+		_data = std::shared_ptr<const char>( data_, data_->data() );
+		_size = data_->size();
+	}
+
+private:
+	std::shared_ptr<const char>	_data;
+	size_t						_size{0};
+}; // class ntsimage
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+// Read-only stream buffer over a file that a background thread reads
+// ahead in chunks, so decoding overlaps the disk reads. At most chunks
+// buffers of chunk_size bytes are in flight. Seeks can go forward or
+// back within the current chunk.
+class ntsprefetchbuf : public std::streambuf {
+public:
+	static const size_t default_chunk = 4 << 20;
+	static const size_t default_chunks = 4;
+	
+	bool open( const char* filename,
+			   const size_t chunk_size = default_chunk,
+			   const size_t chunks = default_chunks ) {
+		close();
+		int fd_ = ::open( filename, O_RDONLY );
+		if( fd_ < 0 )
+			return( false );
+		struct stat stat_;
+		if( ::fstat( fd_, &stat_ ) != 0 ) {
+			::close( fd_ );
+			return( false );
+		}
+#if defined( POSIX_FADV_SEQUENTIAL )
+		::posix_fadvise( fd_, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+		_fd = fd_;
+		_size = static_cast<size_t>( stat_.st_size );
+		_chunk = std::max( chunk_size, static_cast<size_t>( 1 ) );
+		for( size_t i = 0; i < std::max( chunks, static_cast<size_t>( 1 ) );
+			 ++i ) {
+			_free.emplace_back( _chunk );
+		}
+		_done = false;
+		_reader = std::thread( &ntsprefetchbuf::_read_ahead, this );
+		return( true );
+	}
+	void close() {
+		if( _reader.joinable() ) {
+			{
+				std::lock_guard<std::mutex> lck_( _mtx );
+				_stop = true;
+			}
+			_cv.notify_all();
+			_reader.join();
+		}
+		if( _fd >= 0 )
+			::close( _fd );
+		_fd = -1;
+		_size = 0;
+		_start = 0;
+		_stop = false;
+		// Nothing more will come until the next open()
+		_done = true;
+		_failed = false;
+		_wait_us = 0;
+		_current.clear();
+		_ready.clear();
+		_free.clear();
+		setg( nullptr, nullptr, nullptr );
+	}
+	bool is_open() const {
+		return( _fd >= 0 );
+	}
+	// File size, position and what is left from there
+	size_t size() const {
+		return( _size );
+	}
+	size_t position() const {
+		return( _start + static_cast<size_t>( gptr() - eback() ) );
+	}
+	size_t remaining() const {
+		return( _size - position() );
+	}
+	// False after a read error, the data then ends early
+	bool ok() {
+		std::lock_guard<std::mutex> lck_( _mtx );
+		return( !_failed );
+	}
+	// Time the decoding side waited for the disk
+	uint64_t wait_us() const {
+		return( _wait_us );
+	}
+	
+	ntsprefetchbuf() {
+		
+	}
+	~ntsprefetchbuf() {
+		close();
+	}
+
+protected:
+	int_type underflow() override {
+		if( gptr() < egptr() || _next() )
+			return( traits_type::to_int_type( *gptr() ) );
+		return( traits_type::eof() );
+	}
+	std::streamsize showmanyc() override {
+		const size_t left_ = remaining();
+		if( left_ == 0 )
+			return( -1 );
+		return( static_cast<std::streamsize>( std::min( left_,
+			static_cast<size_t>(
+				std::numeric_limits<std::streamsize>::max() ) ) ) );
+	}
+	pos_type seekoff( off_type off, std::ios_base::seekdir dir,
+					  std::ios_base::openmode which ) override {
+		if( ( which & std::ios_base::out ) != 0 )
+			return( pos_type( off_type( -1 ) ) );
+		off_type pos_ = off;
+		if( dir == std::ios_base::cur )
+			pos_ += static_cast<off_type>( position() );
+		else if( dir == std::ios_base::end )
+			pos_ += static_cast<off_type>( _size );
+		if( pos_ < static_cast<off_type>( _start )
+			|| pos_ > static_cast<off_type>( _size ) )
+			return( pos_type( off_type( -1 ) ) );
+		const size_t target_ = static_cast<size_t>( pos_ );
+		while( target_ > _start + static_cast<size_t>( egptr() - eback() ) )
+			if( !_next() )
+				return( pos_type( off_type( -1 ) ) );
+		setg( eback(), eback() + ( target_ - _start ), egptr() );
+		return( pos_type( pos_ ) );
+	}
+	pos_type seekpos( pos_type pos, std::ios_base::openmode which )
+		override {
+		return( seekoff( off_type( pos ), std::ios_base::beg, which ) );
+	}
+
+private:
+	// Hand the current chunk back and wait for the next one
+	bool _next() {
+		std::unique_lock<std::mutex> lck_( _mtx );
+		if( eback() != nullptr ) {
+			_start += static_cast<size_t>( egptr() - eback() );
+			_free.push_back( std::move( _current ) );
+			setg( nullptr, nullptr, nullptr );
+			_cv.notify_all();
+		}
+		if( _ready.empty() && !_done ) {
+			const auto start_ = std::chrono::steady_clock::now();
+			_cv.wait( lck_, [this]() {
+				return( !_ready.empty() || _done );
+			} );
+			_wait_us += static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - start_ ).count() );
+		}
+		if( _ready.empty() )
+			return( false );
+		_current = std::move( _ready.front().first );
+		char* data_ = _current.data();
+		setg( data_, data_, data_ + _ready.front().second );
+		_ready.pop_front();
+		return( true );
+	}
+	// Reader thread: fill free chunks in file order
+	void _read_ahead() {
+		size_t offset_ = 0;
+		bool failed_ = false;
+		while( offset_ < _size && !failed_ ) {
+			std::vector<char> chunk_;
+			{
+				std::unique_lock<std::mutex> lck_( _mtx );
+				_cv.wait( lck_, [this]() {
+					return( _stop || !_free.empty() );
+				} );
+				if( _stop )
+					return;
+				chunk_ = std::move( _free.back() );
+				_free.pop_back();
+			}
+			const size_t want_ = std::min( _chunk, _size - offset_ );
+#if defined( POSIX_FADV_WILLNEED )
+			// Keep the disk busy with the chunk after this one
+			::posix_fadvise( _fd, static_cast<off_t>( offset_ + want_ ),
+							 static_cast<off_t>( _chunk ),
+							 POSIX_FADV_WILLNEED );
+#endif
+			size_t got_ = 0;
+			while( got_ < want_ ) {
+				const off_t at_ = static_cast<off_t>( offset_ + got_ );
+				ssize_t read_ = ::pread( _fd, chunk_.data() + got_,
+										 want_ - got_, at_ );
+				if( read_ < 0 && errno == EINTR )
+					continue;
+				if( read_ <= 0 ) {
+					failed_ = true;
+					break;
+				}
+				got_ += static_cast<size_t>( read_ );
+			}
+			{
+				std::lock_guard<std::mutex> lck_( _mtx );
+				if( got_ != 0 )
+					_ready.emplace_back( std::move( chunk_ ), got_ );
+				_failed = failed_;
+			}
+			_cv.notify_all();
+			offset_ += got_;
+		}
+		std::lock_guard<std::mutex> lck_( _mtx );
+		_done = true;
+		_cv.notify_all();
+	}
+	
+	int			_fd{-1};
+	size_t		_size{0};
+	size_t		_chunk{0};
+	size_t		_start{0};	// File offset of the current chunk
+	uint64_t	_wait_us{0};
+	std::vector<char> _current;
+	std::deque<std::pair<std::vector<char>, size_t>> _ready;
+	std::vector<std::vector<char>> _free;
+	bool		_stop{false};
+	bool		_done{true};
+	bool		_failed{false};
+	std::mutex	_mtx;
+	std::condition_variable _cv;
+	std::thread	_reader;
+}; // class ntsprefetchbuf
+#endif
+
 class NTSerialize {
 public:
 	// Clear stringstream buffer
 	void clear() {
 		_buffer.clear();
 		_buffer.str( std::string() );
+		_metrics.buffer_size = 0;
+		_segments.clear();
+		_strings_out.clear();
+		_strings_in.clear();
+		_pointers_out.clear();
+		_pointers_held.clear();
+		_pointers_in.clear();
+		_error = ntserror::none;
+		_decoded = 0;
 	}
 	// Eval command
 	NTSerialize& operator<<( const ntsdirective command ) {
 		if( command == ntsdirective::clear ) {
 			clear();
 		} else if( command == ntsdirective::posstart ) {
+			_splice();
 			_buffer.seekp( 0, std::ios::beg );
 		} else if( command == ntsdirective::posend ) {
+			_splice();
 			_buffer.seekp( 0, std::ios::end );
 		} else if( command == ntsdirective::debug ) {
 			_is_debug = true;
 		} else if( command == ntsdirective::nodebug ) {
 			_is_debug = false;
+		} else if( command == ntsdirective::metrics ) {
+			_metrics = ntsmetrics();
+			_is_metrics = true;
+		} else if( command == ntsdirective::nometrics ) {
+			_is_metrics = false;
+		} else if( command == ntsdirective::zerocopy ) {
+			_is_zerocopy = true;
+		} else if( command == ntsdirective::nozerocopy ) {
+			_is_zerocopy = false;
+		} else if( command == ntsdirective::dedup ) {
+			_is_dedup = true;
+		} else if( command == ntsdirective::nodedup ) {
+			_is_dedup = false;
+		} else if( command == ntsdirective::packkeys ) {
+			_is_packkeys = true;
+		} else if( command == ntsdirective::nopackkeys ) {
+			_is_packkeys = false;
+		} else if( command == ntsdirective::floatxor ) {
+			_is_floatxor = true;
+		} else if( command == ntsdirective::nofloatxor ) {
+			_is_floatxor = false;
+		} else if( command == ntsdirective::rle ) {
+			_is_rle = true;
+		} else if( command == ntsdirective::norle ) {
+			_is_rle = false;
+		} else if( command == ntsdirective::flat ) {
+			_is_flat = true;
+		} else if( command == ntsdirective::noflat ) {
+			_is_flat = false;
 		}
 		return( *this );
 	}
@@ -96,15 +1029,26 @@ public:
 						<< std::boolalpha << _buffer.good()
 						<< " data: " << data << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &data ),
-						sizeof( T ) );
+		_write(	reinterpret_cast<const char*>( &data ),
+				sizeof( T ) );
 		return( *this );
 	}
 	template<typename T>
 	typename std::enable_if<std::is_fundamental<T>::value,
 							NTSerialize&>::type
 	operator>>( T& data ) {
-		_buffer.read( reinterpret_cast<char*>( &data ), sizeof( T ) );
+		_read( reinterpret_cast<char*>( &data ), sizeof( T ) );
+		if( _is_debug ) {
+			std::lock_guard<std::mutex> lck_( _console_mtx );
+			std::cout 	<< "DEBUG read: stringstream::good() = "
+						<< std::boolalpha << _buffer.good()
+						<< " data: " << data << std::endl;
+		}
+		return( *this );
+	}
+	// Only 0 and 1 are bools, anything else is corrupt
+	NTSerialize& operator>>( bool& data ) {
+		data = _read_flag();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read: stringstream::good() = "
@@ -122,14 +1066,14 @@ public:
 						<< std::boolalpha << _buffer.good()
 						<< " data: [class]" << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &data ),
-						sizeof( T ) );
+		_write(	reinterpret_cast<const char*>( &data ),
+				sizeof( T ) );
 		return( *this );
 	}
 	template<typename T>
 	typename std::enable_if<std::is_class<T>::value, NTSerialize&>::type
 	operator>>( T& data ) {
-		_buffer.read( reinterpret_cast<char*>( &data ), sizeof( T ) );
+		_read( reinterpret_cast<char*>( &data ), sizeof( T ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read: stringstream::good() = "
@@ -140,6 +1084,7 @@ public:
 	}
 	// Serialize STL containers
 	NTSerialize& operator<<( const std::string& data ) {
+		_track track_( *this, ntstype::string );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout	<< "DEBUG write string: stringstream::good() = "
@@ -147,28 +1092,59 @@ public:
 						<< " data: " << data << std::endl;
 		}
 		size_t size_ = data.size();
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
-		_buffer.write(	reinterpret_cast<const char*>( data.c_str() ),
-						size_ );
+		if( _is_dedup ) {
+			// Repeats refer back by distance, new strings are keyed by
+			// where they start
+			const std::streamoff offset_ = _offset_out();
+			auto it_ = _strings_out.find( data );
+			if( it_ != _strings_out.end() && offset_ >= 0 ) {
+				_write_varint( ( ( static_cast<size_t>( offset_ )
+								   - it_->second ) << 1 ) | 1 );
+				return( *this );
+			}
+			if( offset_ >= 0 )
+				_strings_out.emplace( data,
+									  static_cast<size_t>( offset_ ) );
+			_write_varint( size_ << 1 );
+		} else {
+			_write(	reinterpret_cast<const char*>( &size_ ),
+					sizeof( size_t ) );
+		}
+		if( _is_zerocopy && size_ >= zerocopy_threshold )
+			_reference( data.data(), size_ );
+		else
+			_write(	reinterpret_cast<const char*>( data.c_str() ),
+					size_ );
+		track_.add( size_ );
 		return( *this );
 	}
 	NTSerialize& operator>>( std::string& data ) {
+		_track track_( *this, ntstype::string );
+		if( _is_dedup ) {
+			_read_dedup( data );
+			if( _buffer.good() )
+				track_.add( data.size() );
+			return( *this );
+		}
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
+		if( !_admit<char>( size_ ) )
+			return( *this );
 		data.resize( size_ );
-		_buffer.read( const_cast<char*>( data.c_str() ), size_ );
+		_read( const_cast<char*>( data.c_str() ), size_ );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read string: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data: " << data << std::endl;
 		}
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator<<( const std::vector<T>& data ) {
+		_track track_( *this, ntstype::vector );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG write vector: stringstream::good() = "
@@ -176,32 +1152,59 @@ public:
 						<< " data size: " << data.size() << std::endl;
 		}
 		size_t size_ = data.size();
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
-		for( auto it = data.cbegin(); it != data.cend(); ++it )
-			*this << *it;
+		if( _is_floatxor && ntsxor<T>::value ) {
+			_write_xor( data.cbegin(), size_, ntsxor<T>() );
+		} else if( ntsbulk<T>::value && ( _is_rle || !_is_debug ) ) {
+			_write_bulk( data.data(), size_, ntsbulk<T>() );
+		} else if( _is_flat && ntsflatten<T>::value ) {
+			_write_flat( data.cbegin(), size_, ntsflatten<T>() );
+		} else {
+			for( auto it = data.cbegin(); it != data.cend(); ++it )
+				*this << *it;
+		}
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator>>( std::vector<T>& data ) {
+		_track track_( *this, ntstype::vector );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read vector: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		data.resize( size_ );
-		for( size_t i = 0; i < size_; ++i )
-			*this >> data[i];
+		if( !_admit<T>( size_, _is_floatxor && ntsxor<T>::value ? _packed
+							   : _is_rle && ntsbulk<T>::value ? _runs
+							   : _plain ) )
+			return( *this );
+		if( _is_floatxor && ntsxor<T>::value ) {
+			data.resize( size_ );
+			_read_xor( data.begin(), size_, ntsxor<T>() );
+		} else if( ntsbulk<T>::value && ( _is_rle || !_is_debug ) ) {
+			// Sized once the runs are known to add up to the count
+			_read_bulk( data, size_, ntsbulk<T>() );
+		} else if( _is_flat && ntsflatten<T>::value ) {
+			data.resize( size_ );
+			_read_flat( data, size_, ntsflatten<T>() );
+		} else {
+			data.resize( size_ );
+			for( size_t i = 0; i < size_; ++i )
+				*this >> data[i];
+		}
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	NTSerialize& operator<<( const std::vector<bool>& data ) {
+		_track track_( *this, ntstype::vector );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -210,18 +1213,20 @@ public:
 				<< " data size: " << data.size() << std::endl;
 		}
 		size_t size_ = data.size();
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
 		for( auto it = data.cbegin(); it != data.cend(); ++it )
 			*this << *it;
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	NTSerialize& operator>>( std::vector<bool>& data ) {
+		_track track_( *this, ntstype::vector );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -229,6 +1234,8 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
+		if( !_admit<bool>( size_ ) )
+			return( *this );
 		data.resize( size_ );
 		for( size_t i = 0; i < size_; ++i ) {
 			bool val_;
@@ -236,10 +1243,12 @@ public:
 			data[i] = val_;
 		}
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator<<( const std::deque<T>& data ) {
+		_track track_( *this, ntstype::deque );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG write deque: stringstream::good() = "
@@ -247,33 +1256,48 @@ public:
 						<< " data size: " << data.size() << std::endl;
 		}
 		size_t size_ = data.size();
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
-		for( auto it = data.cbegin(); it != data.cend(); ++it )
-			*this << *it;
+		if( _is_floatxor && ntsxor<T>::value ) {
+			_write_xor( data.cbegin(), size_, ntsxor<T>() );
+		} else {
+			for( auto it = data.cbegin(); it != data.cend(); ++it )
+				*this << *it;
+		}
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator>>( std::deque<T>& data ) {
+		_track track_( *this, ntstype::deque );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read deque: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
+		if( !_admit<T>( size_, _is_floatxor && ntsxor<T>::value
+							   ? _packed : _plain ) )
+			return( *this );
 		data.resize( size_ );
-		for( size_t i = 0; i < size_; ++i )
-			*this >> data[i];
+		if( _is_floatxor && ntsxor<T>::value ) {
+			_read_xor( data.begin(), size_, ntsxor<T>() );
+		} else {
+			for( size_t i = 0; i < size_; ++i )
+				*this >> data[i];
+		}
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator<<( const std::forward_list<T>& data ) {
+		_track track_( *this, ntstype::forward_list );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -282,19 +1306,21 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
 		for( auto it = data.cbegin(); it != data.cend(); ++it )
 			*this << *it;
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator>>( std::forward_list<T>& data ) {
+		_track track_( *this, ntstype::forward_list );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -302,14 +1328,18 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
+		if( !_admit<T>( size_ ) )
+			return( *this );
 		data.resize( size_ );
 		for( auto it = data.begin(); it != data.end(); ++it )
 			*this >> *it;
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator<<( const std::list<T>& data ) {
+		_track track_( *this, ntstype::list );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -317,33 +1347,39 @@ public:
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
 		for( auto it = data.cbegin(); it != data.cend(); ++it )
 			*this << *it;
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator>>( std::list<T>& data ) {
+		_track track_( *this, ntstype::list );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read list: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
+		if( !_admit<T>( size_ ) )
+			return( *this );
 		data.resize( size_ );
 		for( auto it = data.begin(); it != data.end(); ++it )
 			*this >> *it;
 		
+		track_.add( size_ );
 		return( *this );
 	}
-	template<typename T>
-	NTSerialize& operator<<( const std::queue<T>& data ) {
+	template<typename T, typename C>
+	NTSerialize& operator<<( const std::queue<T, C>& data ) {
+		_track track_( *this, ntstype::queue );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -351,37 +1387,37 @@ public:
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
-		
-		for( size_t i = 0; i < size_; ++i ) {
-			*this << data.front();
-			data.pop();
-		}
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
+		_write_elements( _adaptor<std::queue<T, C>>::get( data ), false );
 		
+		track_.add( size_ );
 		return( *this );
 	}
-	template<typename T>
-	NTSerialize& operator>>( std::queue<T>& data ) {
+	template<typename T, typename C>
+	NTSerialize& operator>>( std::queue<T, C>& data ) {
+		_track track_( *this, ntstype::queue );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read queue: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		for( size_t i = 0; i < size_; ++i ) {
-			T val_;
-			*this >> val_;
-			data.push( val_ );
-		}
+		if( !_admit<T>( size_ ) )
+			return( *this );
+		_read_elements( _adaptor<std::queue<T, C>>::get( data ), size_,
+						false );
 		
+		track_.add( size_ );
 		return( *this );
 	}
-	template<typename T>
-	NTSerialize& operator<<( const std::priority_queue<T>& data ) {
+	// The heap array is written as it is and restored in O(n)
+	template<typename T, typename C, typename P>
+	NTSerialize& operator<<( const std::priority_queue<T, C, P>& data ) {
+		_track track_( *this, ntstype::priority_queue );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -390,21 +1426,20 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
-		
-		for( size_t i = 0; i < size_; ++i ) {
-			*this << data.top();
-			data.pop();
-		}
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
+		_write_elements(
+			_adaptor<std::priority_queue<T, C, P>>::get( data ), false );
 		
+		track_.add( size_ );
 		return( *this );
 	}
-	template<typename T>
-	NTSerialize& operator>>( std::priority_queue<T>& data ) {
+	template<typename T, typename C, typename P>
+	NTSerialize& operator>>( std::priority_queue<T, C, P>& data ) {
+		_track track_( *this, ntstype::priority_queue );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -412,16 +1447,22 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
-		for( size_t i = 0; i < size_; ++i ) {
-			T val_;
-			*this >> val_;
-			data.push( val_ );
-		}
+		if( !_admit<T>( size_ ) )
+			return( *this );
+		typedef _adaptor<std::priority_queue<T, C, P>> adaptor_;
+		C& heap_ = adaptor_::get( data );
+		_read_elements( heap_, size_, false );
+		// Files written in sorted order are valid heaps too
+		std::make_heap( heap_.begin(), heap_.end(),
+						adaptor_::compare( data ) );
 		
+		track_.add( size_ );
 		return( *this );
 	}
-	template<typename T>
-	NTSerialize& operator<<( std::stack<T>& data ) {
+	// Written from the top down
+	template<typename T, typename C>
+	NTSerialize& operator<<( const std::stack<T, C>& data ) {
+		_track track_( *this, ntstype::stack );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -429,99 +1470,110 @@ public:
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
-		std::vector<T> temp_;
-		temp_.resize( size_ );
-		
-		for( size_t i = 0; i < size_; ++i ) {
-			*this << data.top();
-			temp_[i] = data.top();
-			data.pop();
-		}
-		for( auto it = temp_.crbegin(); it != temp_.crend(); ++it ) {
-			data.push( *it );
-		}
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
+		_write_elements( _adaptor<std::stack<T, C>>::get( data ), true );
 		
+		track_.add( size_ );
 		return( *this );
 	}
-	template<typename T>
-	NTSerialize& operator>>( std::stack<T>& data ) {
+	template<typename T, typename C>
+	NTSerialize& operator>>( std::stack<T, C>& data ) {
+		_track track_( *this, ntstype::stack );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read stack: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		std::vector<T> temp_;
-		temp_.resize( size_ );
-		
-		for( size_t i = 0; i < size_; ++i ) {
-			T val_;
-			*this >> val_;
-			temp_[i] = val_;
-		}
-		
-		for( auto it = temp_.crbegin(); it != temp_.crend(); ++it )
-			data.push( *it );
+		if( !_admit<T>( size_ ) )
+			return( *this );
+		_read_elements( _adaptor<std::stack<T, C>>::get( data ), size_,
+						true );
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T, size_t N>
 	NTSerialize& operator<<( const std::array<T, N>& data ) {
+		_track track_( *this, ntstype::array );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG write array: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << N << std::endl;
 		}
-		for( size_t i = 0; i < N; ++i )
-			*this << data[i];
+		if( ntsbulk<T>::value && ( _is_rle || !_is_debug ) ) {
+			_write_bulk( data.data(), N, ntsbulk<T>() );
+		} else {
+			for( size_t i = 0; i < N; ++i )
+				*this << data[i];
+		}
 		
+		track_.add( N );
 		return( *this );
 	}
 	template<typename T, size_t N>
 	NTSerialize& operator>>( std::array<T, N>& data ) {
+		_track track_( *this, ntstype::array );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read array: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << N << std::endl;
 		}
-		for( size_t i = 0; i < N; ++i )
-			*this >> data[i];
+		if( ntsbulk<T>::value && ( _is_rle || !_is_debug ) ) {
+			_read_bulk( data.data(), N, ntsbulk<T>() );
+		} else {
+			for( size_t i = 0; i < N; ++i )
+				*this >> data[i];
+		}
 		
+		track_.add( N );
 		return( *this );
 	}
 	template<typename T, size_t N>
 	NTSerialize& operator<<( const T (&data)[N] ) {
+		_track track_( *this, ntstype::array );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG write []: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << N << std::endl;
 		}
-		for( size_t i = 0; i < N; ++i )
-			*this << data[i];
+		if( ntsbulk<T>::value && ( _is_rle || !_is_debug ) ) {
+			_write_bulk( data, N, ntsbulk<T>() );
+		} else {
+			for( size_t i = 0; i < N; ++i )
+				*this << data[i];
+		}
+		track_.add( N );
 		return( *this );
 	}
 	template<typename T, size_t N>
 	NTSerialize& operator>>( T (&data)[N] ) {
+		_track track_( *this, ntstype::array );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read []: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << N << std::endl;
 		}
-		for( size_t i = 0; i < N; ++i )
-			*this >> data[i];
+		if( ntsbulk<T>::value && ( _is_rle || !_is_debug ) ) {
+			_read_bulk( data, N, ntsbulk<T>() );
+		} else {
+			for( size_t i = 0; i < N; ++i )
+				*this >> data[i];
+		}
+		track_.add( N );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator<<( const std::set<T>& data ) {
+		_track track_( *this, ntstype::set );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -529,34 +1581,50 @@ public:
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
-		for( auto it = data.cbegin(); it != data.cend(); ++it )
-			*this << *it;
+		if( !_is_packkeys || !_write_packed<T>( data.cbegin(), size_,
+												ntspacked<T>() ) ) {
+			for( auto it = data.cbegin(); it != data.cend(); ++it )
+				*this << *it;
+		}
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator>>( std::set<T>& data ) {
+		_track track_( *this, ntstype::set );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read set: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		for( size_t i = 0; i < size_; ++i ) {
-			T val_;
-			*this >> val_;
-			data.insert( val_ );
+		if( !_admit<T>( size_, _is_packkeys && ntspacked<T>::value
+							   ? _packed : _plain ) )
+			return( *this );
+		if( _is_packkeys && ntspacked<T>::value ) {
+			_read_packed<T>( size_, [&data]( const T& key ) {
+				data.emplace_hint( data.end(), key );
+			}, ntspacked<T>() );
+		} else {
+			for( size_t i = 0; i < size_; ++i ) {
+				T val_;
+				*this >> val_;
+				data.emplace_hint( data.end(), std::move( val_ ) );
+			}
 		}
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator<<( const std::multiset<T>& data ) {
+		_track track_( *this, ntstype::multiset );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -565,19 +1633,24 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
-		for( auto it = data.cbegin(); it != data.cend(); ++it )
-			*this << *it;
+		if( !_is_packkeys || !_write_packed<T>( data.cbegin(), size_,
+												ntspacked<T>() ) ) {
+			for( auto it = data.cbegin(); it != data.cend(); ++it )
+				*this << *it;
+		}
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator>>( std::multiset<T>& data ) {
+		_track track_( *this, ntstype::multiset );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -585,16 +1658,27 @@ public:
 					<< std::boolalpha << _buffer.good()
 					<< " data size: " << size_ << std::endl;
 		}
-		for( size_t i = 0; i < size_; ++i ) {
-			T val_;
-			*this >> val_;
-			data.insert( val_ );
+		if( !_admit<T>( size_, _is_packkeys && ntspacked<T>::value
+							   ? _packed : _plain ) )
+			return( *this );
+		if( _is_packkeys && ntspacked<T>::value ) {
+			_read_packed<T>( size_, [&data]( const T& key ) {
+				data.emplace_hint( data.end(), key );
+			}, ntspacked<T>() );
+		} else {
+			for( size_t i = 0; i < size_; ++i ) {
+				T val_;
+				*this >> val_;
+				data.emplace_hint( data.end(), std::move( val_ ) );
+			}
 		}
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator<<( const std::unordered_set<T>& data ) {
+		_track track_( *this, ntstype::unordered_set );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -603,19 +1687,21 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
 		for( auto it = data.cbegin(); it != data.cend(); ++it )
 			*this << *it;
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator>>( std::unordered_set<T>& data ) {
+		_track track_( *this, ntstype::unordered_set );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -623,15 +1709,19 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
+		if( !_admit<T>( size_ ) )
+			return( *this );
 		for( size_t i = 0; i < size_; ++i ) {
 			T val_;
 			*this >> val_;
 			data.insert( val_ );
 		}
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator<<( const std::unordered_multiset<T>& data ) {
+		_track track_( *this, ntstype::unordered_multiset );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -640,19 +1730,21 @@ public:
 			<< std::boolalpha << _buffer.good()
 			<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
 		for( auto it = data.cbegin(); it != data.cend(); ++it )
 			*this << *it;
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T>
 	NTSerialize& operator>>( std::unordered_multiset<T>& data ) {
+		_track track_( *this, ntstype::unordered_multiset );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -660,12 +1752,15 @@ public:
 			<< std::boolalpha << _buffer.good()
 			<< " data size: " << size_ << std::endl;
 		}
+		if( !_admit<T>( size_ ) )
+			return( *this );
 		for( size_t i = 0; i < size_; ++i ) {
 			T val_;
 			*this >> val_;
 			data.insert( val_ );
 		}
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T1, typename T2>
@@ -696,6 +1791,7 @@ public:
 	}
 	template<typename T1, typename T2>
 	NTSerialize& operator<<( const std::map<T1, T2>& data ) {
+		_track track_( *this, ntstype::map );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -703,35 +1799,38 @@ public:
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
-		for( auto it = data.cbegin(); it != data.cend(); ++it )
-			*this << *it;
+		_write_entries( data, ntspacked<T1>() );
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T1, typename T2>
 	NTSerialize& operator>>( std::map<T1, T2>& data ) {
+		_track track_( *this, ntstype::map );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout 	<< "DEBUG read map: stringstream::good() = "
 						<< std::boolalpha << _buffer.good()
 						<< " data size: " << size_ << std::endl;
 		}
-		for( size_t i = 0; i < size_; ++i ) {
-			std::pair<T1, T2> val_;
-			*this >> val_;
-			data.insert( val_ );
-		}
+		if( !_admit<std::pair<T1, T2>>( size_, _is_packkeys
+										&& ntspacked<T1>::value
+										? _packed : _plain ) )
+			return( *this );
+		_read_entries( data, size_, ntspacked<T1>() );
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T1, typename T2>
 	NTSerialize& operator<<( const std::multimap<T1, T2>& data ) {
+		_track track_( *this, ntstype::multimap );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -740,19 +1839,20 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
-		for( auto it = data.cbegin(); it != data.cend(); ++it )
-			*this << *it;
+		_write_entries( data, ntspacked<T1>() );
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T1, typename T2>
 	NTSerialize& operator>>( std::multimap<T1, T2>& data ) {
+		_track track_( *this, ntstype::multimap );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -760,16 +1860,18 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
-		for( size_t i = 0; i < size_; ++i ) {
-			std::pair<T1, T2> val_;
-			*this >> val_;
-			data.insert( val_ );
-		}
+		if( !_admit<std::pair<T1, T2>>( size_, _is_packkeys
+										&& ntspacked<T1>::value
+										? _packed : _plain ) )
+			return( *this );
+		_read_entries( data, size_, ntspacked<T1>() );
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T1, typename T2>
 	NTSerialize& operator<<( const std::unordered_map<T1, T2>& data ) {
+		_track track_( *this, ntstype::unordered_map );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -778,19 +1880,20 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
-		for( auto it = data.cbegin(); it != data.cend(); ++it )
-			*this << *it;
+		_write_entries( data, std::false_type() );
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T1, typename T2>
 	NTSerialize& operator>>( std::unordered_map<T1, T2>& data ) {
+		_track track_( *this, ntstype::unordered_map );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -798,16 +1901,16 @@ public:
 				<< std::boolalpha << _buffer.good()
 				<< " data size: " << size_ << std::endl;
 		}
-		for( size_t i = 0; i < size_; ++i ) {
-			std::pair<T1, T2> val_;
-			*this >> val_;
-			data.insert( val_ );
-		}
+		if( !_admit<std::pair<T1, T2>>( size_ ) )
+			return( *this );
+		_read_entries( data, size_, std::false_type() );
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T1, typename T2>
 	NTSerialize& operator<<(const std::unordered_multimap<T1,T2>& data){
+		_track track_( *this, ntstype::unordered_multimap );
 		size_t size_ = data.size();
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
@@ -816,19 +1919,20 @@ public:
 			<< std::boolalpha << _buffer.good()
 			<< " data size: " << size_ << std::endl;
 		}
-		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
-						sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
 		
-		for( auto it = data.cbegin(); it != data.cend(); ++it )
-			*this << *it;
+		_write_entries( data, std::false_type() );
 		
+		track_.add( size_ );
 		return( *this );
 	}
 	template<typename T1, typename T2>
 	NTSerialize& operator>>( std::unordered_multimap<T1, T2>& data ) {
+		_track track_( *this, ntstype::unordered_multimap );
 		size_t size_ = 0;
-		_buffer.read(	reinterpret_cast<char*>( &size_ ),
-						sizeof( size_t ) );
+		_read(	reinterpret_cast<char*>( &size_ ),
+				sizeof( size_t ) );
 		if( _is_debug ) {
 			std::lock_guard<std::mutex> lck_( _console_mtx );
 			std::cout
@@ -836,26 +1940,347 @@ public:
 			<< std::boolalpha << _buffer.good()
 			<< " data size: " << size_ << std::endl;
 		}
-		for( size_t i = 0; i < size_; ++i ) {
-			std::pair<T1, T2> val_;
-			*this >> val_;
-			data.insert( val_ );
-		}
+		if( !_admit<std::pair<T1, T2>>( size_ ) )
+			return( *this );
+		_read_entries( data, size_, std::false_type() );
 		
+		track_.add( size_ );
+		return( *this );
+	}
+	
+	// Shared objects are written once. Each pointer is written as an id:
+	// 0 for null, the next unused id followed by the object the first
+	// time, and just the id afterwards. Ids live until clear(). Objects
+	// are told apart by address and type, and an id read back has to
+	// name an object of the same type.
+	template<typename T>
+	NTSerialize& operator<<( const std::shared_ptr<T>& data ) {
+		_track track_( *this, ntstype::pointer );
+		size_t id_ = 0;
+		bool new_ = false;
+		if( data ) {
+			const _pointer_key key_( static_cast<const void*>( data.get() ),
+									 _type_tag<T>() );
+			auto it_ = _pointers_out.find( key_ );
+			if( it_ != _pointers_out.end() ) {
+				id_ = it_->second;
+			} else {
+				id_ = _pointers_out.size() + 1;
+				_pointers_out.emplace( key_, id_ );
+				// Keeps the address from being reused by another object
+				_pointers_held.push_back( data );
+				new_ = true;
+			}
+		}
+		if( _is_debug ) {
+			std::lock_guard<std::mutex> lck_( _console_mtx );
+			std::cout
+				<< "DEBUG write shared_ptr: stringstream::good() = "
+				<< std::boolalpha << _buffer.good()
+				<< " id: " << id_ << std::endl;
+		}
+		_write(	reinterpret_cast<const char*>( &id_ ),
+				sizeof( size_t ) );
+		if( new_ ) {
+			*this << *data;
+			track_.add( 1 );
+		}
+		return( *this );
+	}
+	template<typename T>
+	NTSerialize& operator>>( std::shared_ptr<T>& data ) {
+		_track track_( *this, ntstype::pointer );
+		size_t id_ = _read_size();
+		if( _is_debug ) {
+			std::lock_guard<std::mutex> lck_( _console_mtx );
+			std::cout
+				<< "DEBUG read shared_ptr: stringstream::good() = "
+				<< std::boolalpha << _buffer.good()
+				<< " id: " << id_ << std::endl;
+		}
+		if( id_ == 0 || !_buffer.good() ) {
+			data.reset();
+		} else if( id_ <= _pointers_in.size()
+				   && _pointers_in[id_ - 1].second == _type_tag<T>() ) {
+			data = std::static_pointer_cast<T>(
+				_pointers_in[id_ - 1].first );
+		} else if( id_ == _pointers_in.size() + 1 ) {
+			// Registered first, so cycles back to it resolve
+			auto value_ =
+				std::make_shared<typename std::remove_const<T>::type>();
+			_pointers_in.emplace_back( value_, _type_tag<T>() );
+			data = value_;
+			*this >> *value_;
+			track_.add( 1 );
+		} else {
+			data.reset();
+			_fail( ntserror::corrupt );
+		}
+		return( *this );
+	}
+	// Owned objects are prefixed with a flag telling if they are set
+	template<typename T, typename D>
+	NTSerialize& operator<<( const std::unique_ptr<T, D>& data ) {
+		_track track_( *this, ntstype::pointer );
+		bool set_ = static_cast<bool>( data );
+		_write(	reinterpret_cast<const char*>( &set_ ), sizeof( bool ) );
+		if( set_ ) {
+			*this << *data;
+			track_.add( 1 );
+		}
+		return( *this );
+	}
+	// New objects are created with new, so only the default deleter
+	template<typename T>
+	NTSerialize& operator>>( std::unique_ptr<T>& data ) {
+		_track track_( *this, ntstype::pointer );
+		const bool set_ = _read_flag();
+		if( !set_ || !_buffer.good() ) {
+			data.reset();
+			return( *this );
+		}
+		if( !data )
+			data.reset( new T() );
+		*this >> *data;
+		track_.add( 1 );
+		return( *this );
+	}
+	
+	// Lazy members are prefixed with their encoded size, reading only
+	// records where the value is
+	template<typename T>
+	NTSerialize& operator<<( const ntslazy<T>& data ) {
+		const T& value_ = data.get();
+		_sized sized_ = _begin_sized();
+		// Decoded out of order, so it can't share the string table
+		bool dedup_ = _is_dedup;
+		_is_dedup = false;
+		// Its shared objects get their own ids for the same reason
+		_pointer_scope scope_( *this );
+		*this << value_;
+		_is_dedup = dedup_;
+		_end_sized( sized_ );
+		return( *this );
+	}
+	template<typename T>
+	NTSerialize& operator>>( ntslazy<T>& data ) {
+		data._size = _read_size();
+		data._offset = static_cast<size_t>( _buffer.tellg() );
+		data._source = this;
+		data._loaded = false;
+		data._value = T();
+		_seek( data._size );
+		return( *this );
+	}
+	
+	// Flat containers always use the flat encoding, so they read what
+	// flat mode writes for vectors of vectors or strings
+	template<typename T>
+	NTSerialize& operator<<( const ntsflat<T>& data ) {
+		_track track_( *this, ntstype::vector );
+		size_t size_ = data.size();
+		if( _is_debug ) {
+			std::lock_guard<std::mutex> lck_( _console_mtx );
+			std::cout 	<< "DEBUG write flat: stringstream::good() = "
+						<< std::boolalpha << _buffer.good()
+						<< " data size: " << size_ << std::endl;
+		}
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( data._offsets.data() ),
+				data._offsets.size() * sizeof( size_t ) );
+		_write_payload(
+			reinterpret_cast<const char*>( data._values.data() ),
+			data._values.size() * sizeof( T ) );
+		track_.add( size_ );
+		return( *this );
+	}
+	template<typename T>
+	NTSerialize& operator>>( ntsflat<T>& data ) {
+		_track track_( *this, ntstype::vector );
+		size_t size_ = _read_size();
+		if( _is_debug ) {
+			std::lock_guard<std::mutex> lck_( _console_mtx );
+			std::cout 	<< "DEBUG read flat: stringstream::good() = "
+						<< std::boolalpha << _buffer.good()
+						<< " data size: " << size_ << std::endl;
+		}
+		data.clear();
+		if( !_admit<std::vector<T>>( size_ )
+			|| !_read_offsets( data._offsets, size_ )
+			|| !_admit<T>( data._offsets[size_] ) ) {
+			data.clear();
+			return( *this );
+		}
+		data._values.resize( data._offsets[size_] );
+		_read( reinterpret_cast<char*>( data._values.data() ),
+			   data._values.size() * sizeof( T ) );
+		if( !_buffer.good() )
+			data.clear();
+		track_.add( size_ );
+		return( *this );
+	}
+	
+	// Columnar encoding: the row count, the column count and then every
+	// field as its own column prefixed with its size in bytes. Columns of
+	// raw types are contiguous and copied in bulk.
+	template<typename S, typename... F>
+	NTSerialize& write_columns( const std::vector<S>& data,
+								const ntscolumns<S, F...>& columns ) {
+		_track track_( *this, ntstype::vector );
+		size_t size_ = data.size();
+		size_t count_ = sizeof...( F );
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( &count_ ),
+				sizeof( size_t ) );
+		_write_columns( data, columns.fields(),
+						std::index_sequence_for<F...>() );
+		track_.add( size_ );
+		return( *this );
+	}
+	template<typename S, typename... F>
+	NTSerialize& read_columns( std::vector<S>& data,
+							   const ntscolumns<S, F...>& columns ) {
+		_track track_( *this, ntstype::vector );
+		size_t size_ = _read_size();
+		if( _read_size() != sizeof...( F ) ) {
+			_fail( ntserror::corrupt );
+			return( *this );
+		}
+		if( !_admit<S>( size_, _packed ) )
+			return( *this );
+		data.resize( size_ );
+		_read_columns( data, columns.fields(),
+					   std::index_sequence_for<F...>() );
+		track_.add( size_ );
+		return( *this );
+	}
+	// Decode column I alone, the other columns are skipped
+	template<size_t I, typename S, typename... F>
+	NTSerialize& read_column(
+			std::vector<typename ntscolumns<S, F...>::template field<I>>& data,
+			const ntscolumns<S, F...>& columns ) {
+		typedef typename ntscolumns<S, F...>::template field<I> field_t;
+		(void)columns;
+		_track track_( *this, ntstype::vector );
+		size_t size_ = _read_size();
+		if( _read_size() != sizeof...( F ) ) {
+			_fail( ntserror::corrupt );
+			return( *this );
+		}
+		for( size_t i = 0; i < I; ++i )
+			_seek( _read_size() );
+		size_t bytes_ = _read_size();
+		if( !_admit<field_t>( size_ ) )
+			return( *this );
+		data.resize( size_ );
+		if( ntsbulk<field_t>::value ) {
+			if( bytes_ != size_ * sizeof( field_t ) ) {
+				_fail( ntserror::corrupt );
+				return( *this );
+			}
+			_read( reinterpret_cast<char*>( data.data() ), bytes_ );
+		} else {
+			for( size_t i = 0; i < size_; ++i )
+				*this >> data[i];
+		}
+		for( size_t i = I + 1; i < sizeof...( F ); ++i )
+			_seek( _read_size() );
+		track_.add( size_ );
+		return( *this );
+	}
+	
+	// Advance the read position past an encoded T without decoding it.
+	// Only user types with their own operator>> are decoded.
+	template<typename T>
+	NTSerialize& skip() {
+		_skip( static_cast<T*>( nullptr ) );
 		return( *this );
 	}
 	
 	std::stringstream& get() {
+		_splice();
 		return( _buffer );
 	}
 	std::streampos pos() {
+		_splice();
 		return( _buffer.tellg() );
 	}
+	// Size of the written data, referenced payloads included
+	size_t size() {
+		std::streampos pos_ = _buffer.tellp();
+		_buffer.seekp( 0, std::ios::end );
+		size_t size_ = static_cast<size_t>( _buffer.tellp() );
+		_buffer.seekp( pos_ );
+		for( const _segment& segment_ : _segments )
+			size_ += segment_.size;
+		return( size_ );
+	}
 	void pos( size_t pos, std::ios_base::seekdir way ) {
+		_splice();
 		_buffer.seekg( pos, way );
 	}
 	
+	// Encode into and decode from another stream buffer, such as an
+	// ntsmembuf over shared memory, until detach(). save() and load()
+	// keep using the internal buffer.
+	NTSerialize& attach( std::streambuf& buffer ) {
+		_splice();
+		_buffer.std::ios::rdbuf( &buffer );
+		return( *this );
+	}
+	NTSerialize& detach() {
+		_buffer.std::ios::rdbuf( _stream->rdbuf() );
+		return( *this );
+	}
+	bool attached() const {
+		return( _buffer.std::ios::rdbuf() != _stream->rdbuf() );
+	}
+	// Freeze a copy of the written data for cursors. An attached buffer
+	// is read from its start, the image is empty if it can't seek back.
+	ntsimage image() {
+		if( !attached() ) {
+			_splice();
+			return( ntsimage( _stream->str() ) );
+		}
+		std::streambuf* sb_ = _buffer.std::ios::rdbuf();
+		const std::streampos pos_ = sb_->pubseekoff( 0, std::ios::cur,
+													 std::ios::in );
+		if( pos_ == std::streampos( -1 )
+			|| sb_->pubseekpos( 0, std::ios::in ) != std::streampos( 0 ) )
+			return( ntsimage() );
+		std::string data_;
+		char chunk_[4096];
+		for( std::streamsize read_ = 1; read_ > 0; ) {
+			read_ = sb_->sgetn( chunk_, sizeof( chunk_ ) );
+			data_.append( chunk_, static_cast<size_t>( read_ ) );
+		}
+		sb_->pubseekpos( pos_, std::ios::in );
+		return( ntsimage( std::move( data_ ) ) );
+	}
+	
+	// Counters are per instance: no locks, just a flag test when disabled
+	ntsmetrics metrics() const {
+		return( _metrics );
+	}
+	
+	// Decoding stops with failbit set and error() telling why
+	NTSerialize& limits( const ntslimits& limits ) {
+		_limits = limits;
+		return( *this );
+	}
+	const ntslimits& limits() const {
+		return( _limits );
+	}
+	ntserror error() const {
+		return( _error );
+	}
+	
 	bool save( const char* filename ) {
+		_timer timer_( *this, _metrics.save_us );
+		if( !_segments.empty() )
+			return( _save_segments( filename ) );
 		std::ofstream ofs_( filename,
 							std::ofstream::out | std::ofstream::trunc
 							| std::ifstream::binary );
@@ -866,6 +2291,7 @@ public:
 		return( ofs_.good() );
 	}
 	bool load( const char* filename ) {
+		_timer timer_( *this, _metrics.load_us );
 		std::ifstream ifs_( filename,
 							std::ifstream::in | std::ifstream::binary );
 		if( !ifs_.is_open() )
@@ -876,18 +2302,2401 @@ public:
 		return( ifs_.good() );
 	}
 	
-	NTSerialize( std::mutex& mtx ) : _console_mtx( mtx ) {
+	// Payloads from this size on are referenced in zerocopy mode. They
+	// must stay alive and unchanged until save() writes them, or until
+	// anything else that needs the bytes copies them into the buffer.
+	// The buffer has to be written sequentially.
+	static const size_t zerocopy_threshold = 64 * 1024;
+	
+	NTSerialize( std::mutex& mtx )
+		: _stream( NTSBufferPool::acquire() ), _buffer( *_stream ),
+		  _console_mtx( mtx ) {
 		
 	}
+	// Read-only cursor over an image, starting at offset. Each cursor
+	// has its own position and tables, so threads can decode the same
+	// image concurrently without locks or copies.
+	NTSerialize( std::mutex& mtx, const ntsimage& image,
+				 const size_t offset = 0 )
+		: _stream( NTSBufferPool::acquire() ), _buffer( *_stream ),
+		  _image( image ), _console_mtx( mtx ) {
+		_view.reset( const_cast<char*>( _image.data() ), 0, _image.size() );
+		attach( _view );
+		_buffer.seekg( static_cast<std::streamoff>( offset ) );
+	}
 	~NTSerialize() {
-		
+		detach();
+		NTSBufferPool::release( std::move( _stream ) );
 	}
 
 private:
-	std::stringstream	_buffer;
-	bool _is_debug{false};
-	std::mutex& _console_mtx;
-}; // class NTSerialize
+	template<typename T> friend class ntslazy;
+	
+	// Attributes IO to a container type while in scope
+	class _track {
+	public:
+		_track( NTSerialize& nts, const ntstype type )
+			: _nts( nts ), _prev( nts._type ) {
+			_nts._type = type;
+			if( ++_nts._depth > _nts._limits.max_depth )
+				_nts._fail( ntserror::depth );
+			if( _nts._is_metrics )
+				++_nts._metrics.types[static_cast<size_t>( type )].calls;
+		}
+		~_track() {
+			_nts._type = _prev;
+			--_nts._depth;
+		}
+		void add( const size_t count ) {
+			if( _nts._is_metrics )
+				_nts._metrics.types[static_cast<size_t>( _nts._type )]
+					.elements += count;
+		}
+	private:
+		NTSerialize&	_nts;
+		ntstype			_prev;
+	};
+	// Shared pointer tables: written objects by address and type, read
+	// objects with their type
+	typedef std::pair<const void*, const void*> _pointer_key;
+	struct _pointer_hash {
+		size_t operator()( const _pointer_key& key ) const {
+			return( std::hash<const void*>()( key.first )
+					^ std::hash<const void*>()( key.second ) * 31 );
+		}
+	};
+	typedef std::unordered_map<_pointer_key, size_t, _pointer_hash>
+		_pointers_map;
+	typedef std::vector<std::pair<std::shared_ptr<void>, const void*>>
+		_pointers_list;
+	// Address unique to T whatever its constness, without RTTI
+	template<typename T>
+	static const void* _type_tag() {
+		return( _unique_tag<typename std::remove_const<T>::type>() );
+	}
+	template<typename T>
+	static const void* _unique_tag() {
+		static const char tag_ = 0;
+		return( &tag_ );
+	}
+	// Swaps in empty shared pointer tables for the scope
+	class _pointer_scope {
+	public:
+		_pointer_scope( NTSerialize& nts ) : _nts( nts ) {
+			_swap();
+		}
+		~_pointer_scope() {
+			_swap();
+		}
+	private:
+		void _swap() {
+			_out.swap( _nts._pointers_out );
+			_held.swap( _nts._pointers_held );
+			_in.swap( _nts._pointers_in );
+		}
+		NTSerialize&								_nts;
+		_pointers_map								_out;
+		std::vector<std::shared_ptr<const void>>	_held;
+		_pointers_list								_in;
+	};
+	// Adds the scope duration to a log2 histogram
+	class _timer {
+	public:
+		_timer( NTSerialize& nts, std::array<uint64_t, 32>& histogram )
+			: _nts( nts ), _histogram( histogram ),
+			  _start( std::chrono::steady_clock::now() ) {
+		}
+		~_timer() {
+			if( !_nts._is_metrics )
+				return;
+			uint64_t us_ = static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - _start ).count() );
+			size_t bucket_ = 0;
+			while( ( us_ >>= 1 ) != 0 && bucket_ < _histogram.size() - 1 )
+				++bucket_;
+			++_histogram[bucket_];
+		}
+	private:
+		NTSerialize&							_nts;
+		std::array<uint64_t, 32>&				_histogram;
+		std::chrono::steady_clock::time_point	_start;
+	};
+	
+	void _write( const char* data, const size_t size ) {
+		if( !_is_metrics ) {
+			_buffer.write( data, size );
+			return;
+		}
+		// The put area only widens when the buffer reallocates
+		const std::streambuf& sb_ = *_buffer.std::ios::rdbuf();
+		const size_t capacity_ = ntsputarea::capacity( sb_ );
+		_buffer.write( data, size );
+		_metrics.bytes_written += size;
+		_metrics.types[static_cast<size_t>( _type )].bytes_written += size;
+		_metrics.buffer_size += size;
+		if( ntsputarea::capacity( sb_ ) > capacity_ )
+			++_metrics.buffer_growths;
+	}
+	size_t _read_size() {
+		size_t size_ = 0;
+		_read( reinterpret_cast<char*>( &size_ ), sizeof( size_t ) );
+		return( size_ );
+	}
+	// A bool read through its byte, never loaded from an invalid one
+	bool _read_flag() {
+		static_assert( sizeof( bool ) == 1, "bools are stored as a byte" );
+		unsigned char byte_ = 0;
+		_read( reinterpret_cast<char*>( &byte_ ), sizeof( bool ) );
+		if( byte_ > 1 ) {
+			_fail( ntserror::corrupt );
+			return( false );
+		}
+		return( byte_ != 0 );
+	}
+	// Raw bools copied in bulk must be 0 or 1 as well. Invalid bytes
+	// are cleared so the array never holds them.
+	template<typename T>
+	void _check_bools( T*, const size_t, std::false_type ) {
+	}
+	template<typename T>
+	void _check_bools( T* data, const size_t count, std::true_type ) {
+		unsigned char* bytes_ = reinterpret_cast<unsigned char*>( data );
+		if( std::find_if( bytes_, bytes_ + count,
+						  []( unsigned char byte ) { return( byte > 1 ); } )
+			!= bytes_ + count ) {
+			std::memset( bytes_, 0, count );
+			_fail( ntserror::corrupt );
+		}
+	}
+	// 7 bits per byte, the high bit set on all but the last
+	void _write_varint( size_t value ) {
+		char bytes_[( sizeof( size_t ) * 8 + 6 ) / 7];
+		size_t count_ = 0;
+		while( value >= 0x80 ) {
+			bytes_[count_++] = static_cast<char>( ( value & 0x7f ) | 0x80 );
+			value >>= 7;
+		}
+		bytes_[count_++] = static_cast<char>( value );
+		_write( bytes_, count_ );
+	}
+	size_t _read_varint() {
+		size_t value_ = 0;
+		for( unsigned int shift_ = 0; shift_ < sizeof( size_t ) * 8;
+			 shift_ += 7 ) {
+			unsigned char byte_ = 0;
+			_read( reinterpret_cast<char*>( &byte_ ), 1 );
+			if( !_buffer.good() )
+				return( 0 );
+			const size_t bits_ = static_cast<size_t>( byte_ & 0x7f );
+			if( ( bits_ << shift_ ) >> shift_ != bits_ )
+				break;
+			value_ |= bits_ << shift_;
+			if( ( byte_ & 0x80 ) == 0 )
+				return( value_ );
+		}
+		_fail( ntserror::corrupt );
+		return( 0 );
+	}
+	// Logical write position, counting the referenced payloads; -1 on
+	// a buffer that can't tell
+	std::streamoff _offset_out() {
+		std::streamoff offset_ = _buffer.tellp();
+		if( offset_ < 0 )
+			return( -1 );
+		for( const _segment& segment_ : _segments )
+			offset_ += static_cast<std::streamoff>( segment_.size );
+		return( offset_ );
+	}
+	// A dedup string: its varint length shifted left and the bytes, or
+	// the distance back to the start of its first occurrence shifted
+	// left with the low bit set. The decode table is keyed by offset,
+	// so reading again after a seek finds the same entries, and a
+	// reference to a string that was skipped decodes it where it is.
+	void _read_dedup( std::string& data ) {
+		_splice();
+		const std::streamoff offset_ = _buffer.tellg();
+		const size_t header_ = _read_varint();
+		if( !_buffer.good() )
+			return;
+		if( ( header_ & 1 ) == 0 ) {
+			const size_t size_ = header_ >> 1;
+			if( !_admit<char>( size_ ) )
+				return;
+			data.resize( size_ );
+			_read( const_cast<char*>( data.c_str() ), size_ );
+			if( _buffer.good() && offset_ >= 0 )
+				_strings_in[static_cast<size_t>( offset_ )] = data;
+			return;
+		}
+		const size_t distance_ = header_ >> 1;
+		if( offset_ < 0 || distance_ == 0
+			|| distance_ > static_cast<size_t>( offset_ ) ) {
+			_fail( ntserror::corrupt );
+			return;
+		}
+		const size_t first_ = static_cast<size_t>( offset_ ) - distance_;
+		auto it_ = _strings_in.find( first_ );
+		if( it_ != _strings_in.end() ) {
+			data = it_->second;
+			return;
+		}
+		// The first occurrence was skipped or seeked past
+		std::streampos pos_ = _buffer.tellg();
+		_buffer.seekg( static_cast<std::streamoff>( first_ ) );
+		const size_t first_header_ = _read_varint();
+		if( _buffer.good() && ( first_header_ & 1 ) != 0 ) {
+			_fail( ntserror::corrupt );
+			return;
+		}
+		const size_t size_ = first_header_ >> 1;
+		if( !_buffer.good() || !_admit<char>( size_ ) )
+			return;
+		data.resize( size_ );
+		_read( const_cast<char*>( data.c_str() ), size_ );
+		if( !_buffer.good() )
+			return;
+		_strings_in[first_] = data;
+		_buffer.seekg( pos_ );
+	}
+	void _seek( const size_t size ) {
+		if( _buffer.good() && !_fits( size, 1 ) ) {
+			_fail( ntserror::truncated );
+			return;
+		}
+		_buffer.seekg( static_cast<std::streamoff>( size ), std::ios::cur );
+	}
+	// Skip count items of size bytes. The count is checked against what
+	// is left before it is multiplied, so a corrupt one can't wrap.
+	void _seek_items( const size_t count, const size_t size ) {
+		if( _buffer.good() && !_fits( count, size ) ) {
+			_fail( ntserror::truncated );
+			return;
+		}
+		_seek( count * size );
+	}
+	// Record the first error and stop decoding
+	void _fail( const ntserror error ) {
+		if( _error == ntserror::none )
+			_error = error;
+		_buffer.setstate( std::ios::failbit );
+	}
+	// How small the elements of a container can get. Packed encodings
+	// take at least 1/128 of the smallest plain one. A sequence in rle
+	// mode is checked in full when it is stored raw, runs can expand to
+	// any length and only need their first header. Dedup strings take
+	// a single byte, wherever they are nested.
+	enum _density { _plain, _packed, _runs };
+
+	// Check a decoded length before anything is allocated for it
+	template<typename T>
+	bool _admit( const size_t count, const _density density = _plain ) {
+		size_t min_ = ( _is_rle && ntsarray<T>::value ) || _is_dedup
+					  ? 1 : ntsminsize<T>::value;
+		size_t checked_ = density == _packed ? count / 128 : count;
+		if( density == _runs && _buffer.good()
+			&& _buffer.std::ios::rdbuf()->sgetc() == _bulk_rle ) {
+			min_ = 1 + 2 * sizeof( size_t ) + sizeof( T );
+			checked_ = count != 0 ? 1 : 0;
+		}
+		ntserror error_ = ntserror::none;
+		if( !_buffer.good() )
+			return( false );
+		if( count > _limits.max_elements )
+			error_ = ntserror::elements;
+		else if( _decoded > _limits.max_bytes
+				 || count > ( _limits.max_bytes - _decoded ) / sizeof( T ) )
+			error_ = ntserror::bytes;
+		else if( !_fits( checked_, min_ ) )
+			error_ = ntserror::truncated;
+		if( error_ != ntserror::none ) {
+			_fail( error_ );
+			return( false );
+		}
+		_decoded += count * sizeof( T );
+		return( true );
+	}
+	// True if count values of at least size bytes can be left to read.
+	// in_avail() may not see writes made after the last read, a seek
+	// brings it up to date before giving up.
+	bool _fits( const size_t count, const size_t size ) {
+		_splice();
+		std::streambuf* sb_ = _buffer.std::ios::rdbuf();
+		std::streamsize avail_ = sb_->in_avail();
+		if( avail_ > 0 && count <= static_cast<size_t>( avail_ ) / size )
+			return( true );
+#if defined( __unix__ ) || defined( __APPLE__ )
+		// Prefetched files know what follows the current chunk
+		ntsprefetchbuf* file_ = dynamic_cast<ntsprefetchbuf*>( sb_ );
+		if( file_ != nullptr )
+			return( count <= file_->remaining() / size );
+#endif
+		sb_->pubseekoff( 0, std::ios::cur, std::ios::in );
+		avail_ = sb_->in_avail();
+		return( avail_ > 0 ? count <= static_cast<size_t>( avail_ ) / size
+						   : count == 0 );
+	}
+	// Skip overloads, the pointer only selects the type
+	template<typename T>
+	void _skip( T* ) {
+		_skip_value<T>( std::integral_constant<bool,
+											ntsfixed<T>::value != 0>() );
+	}
+	template<typename T>
+	void _skip_value( std::true_type ) {
+		if( _is_rle && ntsarray<T>::value ) {
+			_skip_value<T>( std::false_type() );
+			return;
+		}
+		_seek( ntsfixed<T>::value );
+	}
+	template<typename T>
+	void _skip_value( std::false_type ) {
+		T val_;
+		*this >> val_;
+	}
+	template<typename T>
+	void _skip_elements( const size_t count ) {
+		if( ntsfixed<T>::value != 0
+			&& !( _is_rle && ntsarray<T>::value ) ) {
+			_seek_items( count, ntsfixed<T>::value );
+		} else {
+			for( size_t i = 0; i < count && _buffer.good(); ++i )
+				_skip( static_cast<T*>( nullptr ) );
+		}
+	}
+	template<typename T>
+	void _skip( ntslazy<T>* ) {
+		_seek( _read_size() );
+	}
+	// Packed keys: the first key, then blocks of up to packed_block
+	// deltas, each stored as its minimum (uint64_t), a bit width (uint8_t)
+	// and the deltas above the minimum packed at that width. Every value
+	// of a block is extracted by an independent unaligned load, widths
+	// above 56 bits are stored as raw uint64_t.
+	static const size_t packed_block = 128;
+	
+	template<typename K>
+	static const K& _key( const K& key ) {
+		return( key );
+	}
+	template<typename K, typename V>
+	static const K& _key( const std::pair<const K, V>& entry ) {
+		return( entry.first );
+	}
+	template<typename K, typename It>
+	bool _write_packed( It, const size_t, std::false_type ) {
+		return( false );
+	}
+	template<typename K, typename It>
+	bool _write_packed( It it, const size_t count, std::true_type ) {
+		typedef typename std::make_unsigned<K>::type key_t;
+		if( count == 0 )
+			return( true );
+		uint64_t prev_ = static_cast<key_t>( _key( *it ) );
+		_write( reinterpret_cast<const char*>( &prev_ ),
+				sizeof( uint64_t ) );
+		++it;
+		uint64_t deltas_[packed_block];
+		std::vector<unsigned char> bytes_;
+		for( size_t done_ = 1; done_ < count; ) {
+			size_t block_ = std::min( count - done_,
+									  size_t( packed_block ) );
+			uint64_t min_ = ~static_cast<uint64_t>( 0 );
+			uint64_t max_ = 0;
+			for( size_t i = 0; i < block_; ++i, ++it ) {
+				uint64_t key_ = static_cast<key_t>( _key( *it ) );
+				// Modulo the key width, so signed keys wrap correctly
+				deltas_[i] = static_cast<key_t>( key_ - prev_ );
+				prev_ = key_;
+				min_ = std::min( min_, deltas_[i] );
+				max_ = std::max( max_, deltas_[i] );
+			}
+			unsigned char width_ = 0;
+			for( uint64_t range_ = max_ - min_; range_ != 0; range_ >>= 1 )
+				++width_;
+			_write( reinterpret_cast<const char*>( &min_ ),
+					sizeof( uint64_t ) );
+			_write( reinterpret_cast<const char*>( &width_ ), 1 );
+			if( width_ > 56 ) {
+				_write( reinterpret_cast<const char*>( deltas_ ),
+						block_ * sizeof( uint64_t ) );
+			} else {
+				bytes_.assign( ( block_ * width_ + 7 ) / 8 + 8, 0 );
+				for( size_t i = 0; i < block_; ++i ) {
+					size_t bit_ = i * width_;
+					uint64_t word_;
+					std::memcpy( &word_, &bytes_[bit_ / 8], 8 );
+					word_ |= ( deltas_[i] - min_ ) << ( bit_ % 8 );
+					std::memcpy( &bytes_[bit_ / 8], &word_, 8 );
+				}
+				_write( reinterpret_cast<const char*>( bytes_.data() ),
+						( block_ * width_ + 7 ) / 8 );
+			}
+			done_ += block_;
+		}
+		return( true );
+	}
+	template<typename K, typename F>
+	void _read_packed( const size_t, F, std::false_type ) {
+	}
+	template<typename K, typename F>
+	void _read_packed( const size_t count, F emit, std::true_type ) {
+		typedef typename std::make_unsigned<K>::type key_t;
+		if( count == 0 )
+			return;
+		uint64_t prev_ = 0;
+		_read( reinterpret_cast<char*>( &prev_ ), sizeof( uint64_t ) );
+		emit( static_cast<K>( static_cast<key_t>( prev_ ) ) );
+		uint64_t deltas_[packed_block];
+		unsigned char bytes_[packed_block * 7 + 8];
+		for( size_t done_ = 1; done_ < count && _buffer.good(); ) {
+			size_t block_ = std::min( count - done_,
+									  size_t( packed_block ) );
+			uint64_t min_ = 0;
+			unsigned char width_ = 0;
+			_read( reinterpret_cast<char*>( &min_ ), sizeof( uint64_t ) );
+			_read( reinterpret_cast<char*>( &width_ ), 1 );
+			if( width_ > 64 ) {
+				_fail( ntserror::corrupt );
+				return;
+			}
+			if( width_ > 56 ) {
+				_read( reinterpret_cast<char*>( deltas_ ),
+					   block_ * sizeof( uint64_t ) );
+			} else {
+				const uint64_t mask_ =
+					( static_cast<uint64_t>( 1 ) << width_ ) - 1;
+				std::memset( bytes_, 0, sizeof( bytes_ ) );
+				_read( reinterpret_cast<char*>( bytes_ ),
+					   ( block_ * width_ + 7 ) / 8 );
+				for( size_t i = 0; i < block_; ++i ) {
+					size_t bit_ = i * width_;
+					uint64_t word_;
+					std::memcpy( &word_, &bytes_[bit_ / 8], 8 );
+					deltas_[i] = min_
+								 + ( ( word_ >> ( bit_ % 8 ) ) & mask_ );
+				}
+			}
+			for( size_t i = 0; i < block_; ++i ) {
+				prev_ = static_cast<key_t>( prev_ + deltas_[i] );
+				emit( static_cast<K>( static_cast<key_t>( prev_ ) ) );
+			}
+			done_ += block_;
+		}
+	}
+	void _skip_packed( const size_t count ) {
+		if( count == 0 )
+			return;
+		_seek( sizeof( uint64_t ) );
+		for( size_t done_ = 1; done_ < count && _buffer.good(); ) {
+			size_t block_ = std::min( count - done_,
+									  size_t( packed_block ) );
+			_seek( sizeof( uint64_t ) );
+			unsigned char width_ = 0;
+			_read( reinterpret_cast<char*>( &width_ ), 1 );
+			_seek( width_ > 56 ? block_ * sizeof( uint64_t )
+							   : ( block_ * width_ + 7 ) / 8 );
+			done_ += block_;
+		}
+	}
+	// XOR compression of floating-point sequences (as in Facebook's
+	// Gorilla): the byte size of the bit stream, the first value raw,
+	// then for every value XORed with its predecessor a 0 bit if equal,
+	// or 10 and the meaningful bits inside the previous window, or 11,
+	// the leading zero count, the meaningful bit count - 1 and the bits.
+	// Values are handled as bit patterns, so NaN payloads round-trip.
+	class _bitwriter {
+	public:
+		void put( const uint64_t value, const unsigned bits ) {
+			if( bits > 32 ) {
+				put( value >> 32, bits - 32 );
+				put( value, 32 );
+				return;
+			}
+			if( bits == 0 )
+				return;
+			const uint64_t mask_ = ( static_cast<uint64_t>( 1 ) << bits ) - 1;
+			_acc = ( _acc << bits ) | ( value & mask_ );
+			_used += bits;
+			while( _used >= 8 ) {
+				_used -= 8;
+				bytes.push_back(
+					static_cast<unsigned char>( _acc >> _used ) );
+			}
+		}
+		void flush() {
+			if( _used > 0 )
+				bytes.push_back(
+					static_cast<unsigned char>( _acc << ( 8 - _used ) ) );
+			_used = 0;
+		}
+		std::vector<unsigned char> bytes;
+	private:
+		uint64_t _acc{0};
+		unsigned _used{0};
+	};
+	class _bitreader {
+	public:
+		_bitreader( const unsigned char* data, const size_t size )
+			: _data( data ), _size( size ) {
+		}
+		uint64_t get( const unsigned bits ) {
+			if( bits > 32 ) {
+				uint64_t high_ = get( bits - 32 );
+				return( ( high_ << 32 ) | get( 32 ) );
+			}
+			while( _used < bits ) {
+				if( _pos == _size ) {
+					failed = true;
+					return( 0 );
+				}
+				_acc = ( _acc << 8 ) | _data[_pos++];
+				_used += 8;
+			}
+			_used -= bits;
+			return( ( _acc >> _used )
+					& ( ( static_cast<uint64_t>( 1 ) << bits ) - 1 ) );
+		}
+		bool failed{false};
+	private:
+		const unsigned char*	_data;
+		size_t					_size;
+		size_t					_pos{0};
+		uint64_t				_acc{0};
+		unsigned				_used{0};
+	};
+	// value is not 0
+	static unsigned _clz( uint64_t value, const unsigned width ) {
+#if defined( __GNUC__ )
+		return( static_cast<unsigned>( __builtin_clzll( value ) )
+				- ( 64 - width ) );
+#else
+		unsigned count_ = 0;
+		for( uint64_t bit_ = static_cast<uint64_t>( 1 ) << ( width - 1 );
+			 ( value & bit_ ) == 0; bit_ >>= 1 )
+			++count_;
+		return( count_ );
+#endif
+	}
+	static unsigned _ctz( uint64_t value ) {
+#if defined( __GNUC__ )
+		return( static_cast<unsigned>( __builtin_ctzll( value ) ) );
+#else
+		unsigned count_ = 0;
+		for( ; ( value & 1 ) == 0; value >>= 1 )
+			++count_;
+		return( count_ );
+#endif
+	}
+	template<typename It>
+	void _write_xor( It, const size_t, std::false_type ) {
+	}
+	template<typename It>
+	void _write_xor( It it, const size_t count, std::true_type ) {
+		typedef typename std::iterator_traits<It>::value_type value_t;
+		typedef typename std::conditional<sizeof( value_t ) == 4,
+										  uint32_t, uint64_t>::type bits_t;
+		const unsigned width_ = sizeof( bits_t ) * 8;
+		const unsigned field_ = width_ == 64 ? 6 : 5;
+		_bitwriter out_;
+		out_.bytes.reserve( count * sizeof( bits_t ) / 2 );
+		bits_t prev_ = 0;
+		unsigned lead_ = width_ + 1;	// No window yet
+		unsigned trail_ = 0;
+		for( size_t i = 0; i < count; ++i, ++it ) {
+			bits_t cur_;
+			value_t value_ = *it;
+			std::memcpy( &cur_, &value_, sizeof( bits_t ) );
+			if( i == 0 ) {
+				out_.put( cur_, width_ );
+				prev_ = cur_;
+				continue;
+			}
+			bits_t xor_ = cur_ ^ prev_;
+			prev_ = cur_;
+			if( xor_ == 0 ) {
+				out_.put( 0, 1 );
+				continue;
+			}
+			unsigned clz_ = _clz( xor_, width_ );
+			unsigned ctz_ = _ctz( xor_ );
+			if( lead_ <= width_ && clz_ >= lead_ && ctz_ >= trail_ ) {
+				out_.put( 2, 2 );
+				out_.put( xor_ >> trail_, width_ - lead_ - trail_ );
+			} else {
+				lead_ = std::min( clz_, ( 1u << field_ ) - 1 );
+				trail_ = ctz_;
+				out_.put( 3, 2 );
+				out_.put( lead_, field_ );
+				out_.put( width_ - lead_ - trail_ - 1, field_ );
+				out_.put( xor_ >> trail_, width_ - lead_ - trail_ );
+			}
+		}
+		out_.flush();
+		size_t bytes_ = out_.bytes.size();
+		_write(	reinterpret_cast<const char*>( &bytes_ ),
+				sizeof( size_t ) );
+		_write(	reinterpret_cast<const char*>( out_.bytes.data() ),
+				bytes_ );
+	}
+	template<typename It>
+	void _read_xor( It, const size_t, std::false_type ) {
+	}
+	template<typename It>
+	void _read_xor( It it, const size_t count, std::true_type ) {
+		typedef typename std::iterator_traits<It>::value_type value_t;
+		typedef typename std::conditional<sizeof( value_t ) == 4,
+										  uint32_t, uint64_t>::type bits_t;
+		const unsigned width_ = sizeof( bits_t ) * 8;
+		const unsigned field_ = width_ == 64 ? 6 : 5;
+		const size_t size_ = _read_size();
+		if( !_admit<unsigned char>( size_ ) )
+			return;
+		std::vector<unsigned char> bytes_( size_ );
+		_read( reinterpret_cast<char*>( bytes_.data() ), bytes_.size() );
+		_bitreader in_( bytes_.data(), bytes_.size() );
+		bits_t prev_ = 0;
+		unsigned lead_ = 0;
+		unsigned trail_ = 0;
+		for( size_t i = 0; i < count && !in_.failed; ++i, ++it ) {
+			if( i == 0 ) {
+				prev_ = static_cast<bits_t>( in_.get( width_ ) );
+			} else if( in_.get( 1 ) != 0 ) {
+				if( in_.get( 1 ) != 0 ) {
+					lead_ = static_cast<unsigned>( in_.get( field_ ) );
+					unsigned bits_ =
+						static_cast<unsigned>( in_.get( field_ ) ) + 1;
+					if( lead_ + bits_ > width_ ) {
+						in_.failed = true;
+						break;
+					}
+					trail_ = width_ - lead_ - bits_;
+				}
+				prev_ ^= static_cast<bits_t>(
+					in_.get( width_ - lead_ - trail_ ) << trail_ );
+			}
+			value_t value_;
+			std::memcpy( &value_, &prev_, sizeof( bits_t ) );
+			*it = value_;
+		}
+		if( in_.failed )
+			_fail( ntserror::corrupt );
+	}
+	// Container adaptors keep their container in a protected member
+	template<typename A>
+	struct _adaptor : A {
+		static const typename A::container_type& get( const A& data ) {
+			return( data.*&_adaptor::c );
+		}
+		static typename A::container_type& get( A& data ) {
+			return( data.*&_adaptor::c );
+		}
+		static const auto& compare( const A& data ) {
+			return( data.*&_adaptor::comp );
+		}
+	};
+	
+	// Elements of an adaptor's container, optionally back to front.
+	// Vectors of raw types are copied in one piece.
+	template<typename C>
+	void _write_elements( const C& data, const bool reversed ) {
+		if( reversed ) {
+			for( auto it = data.rbegin(); it != data.rend(); ++it )
+				*this << *it;
+		} else {
+			for( auto it = data.begin(); it != data.end(); ++it )
+				*this << *it;
+		}
+	}
+	template<typename T, typename A>
+	void _write_elements( const std::vector<T, A>& data,
+						  const bool reversed ) {
+		if( !ntsbulk<T>::value || _is_debug || _is_rle ) {
+			_write_elements<std::vector<T, A>>( data, reversed );
+		} else if( reversed ) {
+			std::vector<T> temp_( data.rbegin(), data.rend() );
+			_write_bulk( temp_.data(), temp_.size(), ntsbulk<T>() );
+		} else {
+			_write_bulk( data.data(), data.size(), ntsbulk<T>() );
+		}
+	}
+	template<typename C>
+	void _read_elements( C& data, const size_t size,
+						 const bool reversed ) {
+		data.resize( size );
+		if( reversed ) {
+			for( auto it = data.rbegin(); it != data.rend(); ++it )
+				*this >> *it;
+		} else {
+			for( auto it = data.begin(); it != data.end(); ++it )
+				*this >> *it;
+		}
+	}
+	template<typename T, typename A>
+	void _read_elements( std::vector<T, A>& data, const size_t size,
+						 const bool reversed ) {
+		if( !ntsbulk<T>::value || _is_debug || _is_rle ) {
+			_read_elements<std::vector<T, A>>( data, size, reversed );
+			return;
+		}
+		data.resize( size );
+		_read_bulk( data.data(), size, ntsbulk<T>() );
+		if( reversed )
+			std::reverse( data.begin(), data.end() );
+	}
+	
+	// Sequences of raw types are copied in one piece. In rle mode they
+	// start with a byte telling if the raw memory or runs follow: the
+	// run count and for each run its length and value. Runs are only
+	// used when they are smaller.
+	enum : unsigned char { _bulk_raw, _bulk_rle };
+	
+	template<typename T>
+	void _write_bulk( const T*, const size_t, std::false_type ) {
+	}
+	template<typename T>
+	void _write_bulk( const T* data, const size_t count, std::true_type ) {
+		const size_t bytes_ = count * sizeof( T );
+		if( _is_rle ) {
+			const size_t run_ = sizeof( size_t ) + sizeof( T );
+			// Stop counting once the runs can't be smaller
+			const size_t limit_ = bytes_ / run_;
+			size_t runs_ = 0;
+			for( size_t i = 0; i < count && runs_ < limit_; ++runs_ )
+				i = _run_end( data, i, count );
+			unsigned char mode_ = runs_ < limit_ ? _bulk_rle : _bulk_raw;
+			_write( reinterpret_cast<const char*>( &mode_ ), 1 );
+			if( mode_ == _bulk_rle ) {
+				std::vector<char> out_( sizeof( size_t ) + runs_ * run_ );
+				char* pos_ = out_.data();
+				std::memcpy( pos_, &runs_, sizeof( size_t ) );
+				pos_ += sizeof( size_t );
+				for( size_t i = 0; i < count; ) {
+					size_t end_ = _run_end( data, i, count );
+					size_t length_ = end_ - i;
+					std::memcpy( pos_, &length_, sizeof( size_t ) );
+					std::memcpy( pos_ + sizeof( size_t ), data + i,
+								 sizeof( T ) );
+					pos_ += run_;
+					i = end_;
+				}
+				_write( out_.data(), out_.size() );
+				return;
+			}
+		}
+		if( _is_zerocopy && bytes_ >= zerocopy_threshold )
+			_reference( reinterpret_cast<const char*>( data ), bytes_ );
+		else
+			_write( reinterpret_cast<const char*>( data ), bytes_ );
+	}
+	template<typename T>
+	void _read_bulk( T*, const size_t, std::false_type ) {
+	}
+	template<typename T>
+	void _read_bulk( T* data, const size_t count, std::true_type ) {
+		unsigned char mode_ = _bulk_raw;
+		if( _is_rle )
+			_read( reinterpret_cast<char*>( &mode_ ), 1 );
+		if( mode_ == _bulk_raw ) {
+			_read( reinterpret_cast<char*>( data ), count * sizeof( T ) );
+			_check_bools( data, count, std::is_same<T, bool>() );
+			return;
+		}
+		if( mode_ != _bulk_rle ) {
+			_fail( ntserror::corrupt );
+			return;
+		}
+		std::vector<std::pair<size_t, T>> runs_;
+		if( !_read_runs( runs_, count ) )
+			return;
+		for( const std::pair<size_t, T>& run_ : runs_ ) {
+			std::fill_n( data, run_.first, run_.second );
+			data += run_.first;
+		}
+	}
+	// A vector is only resized once the count is backed by the data:
+	// raw values were checked by _admit, runs must add up to it
+	template<typename T, typename A>
+	void _read_bulk( std::vector<T, A>&, const size_t, std::false_type ) {
+	}
+	template<typename T, typename A>
+	void _read_bulk( std::vector<T, A>& data, const size_t count,
+					 std::true_type ) {
+		if( _is_rle && _buffer.good()
+			&& _buffer.std::ios::rdbuf()->sgetc() == _bulk_rle ) {
+			unsigned char mode_ = _bulk_raw;
+			_read( reinterpret_cast<char*>( &mode_ ), 1 );
+			std::vector<std::pair<size_t, T>> runs_;
+			if( !_read_runs( runs_, count ) )
+				return;
+			data.clear();
+			data.reserve( count );
+			for( const std::pair<size_t, T>& run_ : runs_ )
+				data.insert( data.end(), run_.first, run_.second );
+			return;
+		}
+		data.resize( count );
+		_read_bulk( data.data(), count, std::true_type() );
+	}
+	// The run headers of count values, each run at least one value
+	// long and all of them adding up to count
+	template<typename T>
+	bool _read_runs( std::vector<std::pair<size_t, T>>& runs,
+					 const size_t count ) {
+		const size_t runs_ = _read_size();
+		if( !_buffer.good() )
+			return( false );
+		if( runs_ > count ) {
+			_fail( ntserror::corrupt );
+			return( false );
+		}
+		if( !_fits( runs_, sizeof( size_t ) + sizeof( T ) ) ) {
+			_fail( ntserror::truncated );
+			return( false );
+		}
+		runs.resize( runs_ );
+		size_t done_ = 0;
+		for( std::pair<size_t, T>& run_ : runs ) {
+			run_.first = _read_size();
+			_read( reinterpret_cast<char*>( &run_.second ), sizeof( T ) );
+			_check_bools( &run_.second, 1, std::is_same<T, bool>() );
+			if( !_buffer.good() )
+				return( false );
+			if( run_.first == 0 || run_.first > count - done_ ) {
+				_fail( ntserror::corrupt );
+				return( false );
+			}
+			done_ += run_.first;
+		}
+		if( done_ != count ) {
+			_fail( ntserror::corrupt );
+			return( false );
+		}
+		return( true );
+	}
+	void _skip_bulk( const size_t count, const size_t size ) {
+		unsigned char mode_ = _bulk_raw;
+		_read( reinterpret_cast<char*>( &mode_ ), 1 );
+		if( !_buffer.good() )
+			return;
+		if( mode_ == _bulk_raw ) {
+			_seek_items( count, size );
+		} else if( mode_ == _bulk_rle ) {
+			const size_t runs_ = _read_size();
+			if( runs_ > count )
+				_fail( ntserror::corrupt );
+			else
+				_seek_items( runs_, sizeof( size_t ) + size );
+		} else {
+			_fail( ntserror::corrupt );
+		}
+	}
+	// End of the run starting at i, values are compared bitwise
+	template<typename T>
+	static size_t _run_end( const T* data, size_t i, const size_t count ) {
+		return( _run_end( reinterpret_cast<const unsigned char*>( data ),
+						  i, count,
+						  std::integral_constant<size_t, sizeof( T )>() ) );
+	}
+	template<size_t N>
+	static size_t _run_end( const unsigned char* data, size_t i,
+							const size_t count,
+							std::integral_constant<size_t, N> ) {
+		const unsigned char* value_ = data + i * N;
+		for( ++i; i < count
+				  && std::memcmp( data + i * N, value_, N ) == 0; ++i ) {
+		}
+		return( i );
+	}
+	static size_t _run_end( const unsigned char* data, size_t i,
+							const size_t count,
+							std::integral_constant<size_t, 1> ) {
+		return( _run_end_words<uint8_t>( data, i, count ) );
+	}
+	static size_t _run_end( const unsigned char* data, size_t i,
+							const size_t count,
+							std::integral_constant<size_t, 2> ) {
+		return( _run_end_words<uint16_t>( data, i, count ) );
+	}
+	static size_t _run_end( const unsigned char* data, size_t i,
+							const size_t count,
+							std::integral_constant<size_t, 4> ) {
+		return( _run_end_words<uint32_t>( data, i, count ) );
+	}
+	static size_t _run_end( const unsigned char* data, size_t i,
+							const size_t count,
+							std::integral_constant<size_t, 8> ) {
+		return( _run_end_words<uint64_t>( data, i, count ) );
+	}
+	template<typename U>
+	static U _load( const unsigned char* data ) {
+		U value_;
+		std::memcpy( &value_, data, sizeof( U ) );
+		return( value_ );
+	}
+	// Whole blocks are compared without an early exit, so the compiler
+	// can vectorize them
+	template<typename U>
+	static size_t _run_end_words( const unsigned char* data, size_t i,
+								  const size_t count ) {
+		const size_t block_ = 32;
+		const U value_ = _load<U>( data + i * sizeof( U ) );
+		for( ++i; i + block_ <= count; i += block_ ) {
+			U diff_ = 0;
+			for( size_t k = 0; k < block_; ++k )
+				diff_ |= _load<U>( data + ( i + k ) * sizeof( U ) )
+						 ^ value_;
+			if( diff_ != 0 )
+				break;
+		}
+		for( ; i < count && _load<U>( data + i * sizeof( U ) ) == value_;
+			 ++i ) {
+		}
+		return( i );
+	}
+	
+	// Map entries are written as pairs. With packed keys or flat values
+	// all the keys come first, then the values in the same order.
+	template<typename K>
+	static const K& _mapped( const K& value ) {
+		return( value );
+	}
+	template<typename K, typename V>
+	static const V& _mapped( const std::pair<const K, V>& entry ) {
+		return( entry.second );
+	}
+	template<typename M, typename P>
+	void _write_entries( const M& data, P packed ) {
+		typedef typename M::key_type key_t;
+		typedef typename M::mapped_type mapped_t;
+		const bool flat_ = _is_flat && ntsflatten<mapped_t>::value;
+		const bool packed_ = _is_packkeys
+							 && _write_packed<key_t>( data.cbegin(),
+													  data.size(), packed );
+		if( !packed_ && !flat_ ) {
+			for( auto it = data.cbegin(); it != data.cend(); ++it )
+				*this << *it;
+			return;
+		}
+		if( !packed_ ) {
+			for( auto it = data.cbegin(); it != data.cend(); ++it )
+				*this << it->first;
+		}
+		if( flat_ ) {
+			_write_flat( data.cbegin(), data.size(),
+						 ntsflatten<mapped_t>() );
+		} else {
+			for( auto it = data.cbegin(); it != data.cend(); ++it )
+				*this << it->second;
+		}
+	}
+	template<typename M, typename P>
+	void _read_entries( M& data, const size_t count, P ) {
+		typedef typename M::key_type key_t;
+		typedef typename M::mapped_type mapped_t;
+		const bool flat_ = _is_flat && ntsflatten<mapped_t>::value;
+		const bool packed_ = _is_packkeys && P::value;
+		if( !packed_ && !flat_ ) {
+			for( size_t i = 0; i < count; ++i ) {
+				std::pair<key_t, mapped_t> val_;
+				*this >> val_;
+				data.emplace_hint( data.end(), std::move( val_ ) );
+			}
+			return;
+		}
+		std::vector<key_t> keys_;
+		if( packed_ ) {
+			_read_packed<key_t>( count, [&keys_]( const key_t& key ) {
+				keys_.push_back( key );
+			}, P() );
+		} else {
+			keys_.resize( count );
+			for( size_t i = 0; i < count; ++i )
+				*this >> keys_[i];
+		}
+		std::vector<mapped_t> values_;
+		if( flat_ ) {
+			values_.resize( keys_.size() );
+			_read_flat( values_, keys_.size(), ntsflatten<mapped_t>() );
+		}
+		for( size_t i = 0; i < keys_.size(); ++i ) {
+			mapped_t val_;
+			if( flat_ )
+				val_ = std::move( values_[i] );
+			else
+				*this >> val_;
+			data.emplace_hint( data.end(), std::move( keys_[i] ),
+							   std::move( val_ ) );
+		}
+	}
+	
+	// Flat nested containers: count + 1 offsets into the payload, the
+	// first one 0, then the elements of all of them back to back. Any
+	// inner container is found without walking the others.
+	template<typename It>
+	void _write_flat( It, const size_t, std::false_type ) {
+	}
+	template<typename It>
+	void _write_flat( It it, const size_t count, std::true_type ) {
+		std::vector<size_t> offsets_( count + 1, 0 );
+		It inner_ = it;
+		for( size_t i = 0; i < count; ++i, ++inner_ )
+			offsets_[i + 1] = offsets_[i] + _mapped( *inner_ ).size();
+		_write( reinterpret_cast<const char*>( offsets_.data() ),
+				offsets_.size() * sizeof( size_t ) );
+		for( size_t i = 0; i < count; ++i, ++it ) {
+			const auto& value_ = _mapped( *it );
+			_write_payload( reinterpret_cast<const char*>( value_.data() ),
+							value_.size() * sizeof( *value_.data() ) );
+		}
+	}
+	template<typename T>
+	void _read_flat( std::vector<T>&, const size_t, std::false_type ) {
+	}
+	template<typename T>
+	void _read_flat( std::vector<T>& data, const size_t count,
+					 std::true_type ) {
+		typedef typename ntsflatten<T>::type value_t;
+		std::vector<size_t> offsets_;
+		if( !_read_offsets( offsets_, count )
+			|| !_admit<value_t>( offsets_[count] ) )
+			return;
+		std::vector<value_t> values_( offsets_[count] );
+		_read( reinterpret_cast<char*>( values_.data() ),
+			   values_.size() * sizeof( value_t ) );
+		if( !_buffer.good() )
+			return;
+		for( size_t i = 0; i < count; ++i )
+			data[i].assign( values_.data() + offsets_[i],
+							values_.data() + offsets_[i + 1] );
+	}
+	// Offsets have to start at 0 and never decrease
+	bool _read_offsets( std::vector<size_t>& offsets, const size_t count ) {
+		offsets.resize( count + 1 );
+		_read( reinterpret_cast<char*>( offsets.data() ),
+			   offsets.size() * sizeof( size_t ) );
+		if( !_buffer.good() )
+			return( false );
+		bool sorted_ = offsets[0] == 0;
+		for( size_t i = 0; i < count; ++i )
+			sorted_ &= offsets[i] <= offsets[i + 1];
+		if( !sorted_ )
+			_fail( ntserror::corrupt );
+		return( sorted_ );
+	}
+	template<typename T>
+	void _skip_flat( const size_t, std::false_type ) {
+	}
+	template<typename T>
+	void _skip_flat( const size_t count, std::true_type ) {
+		const size_t size_ = sizeof( typename ntsflatten<T>::type );
+		if( count >= SIZE_MAX / sizeof( size_t ) ) {
+			_fail( ntserror::truncated );
+			return;
+		}
+		_seek( count * sizeof( size_t ) );
+		size_t total_ = _read_size();
+		if( total_ > SIZE_MAX / size_ )
+			_fail( ntserror::corrupt );
+		else
+			_seek( total_ * size_ );
+	}
+	void _write_payload( const char* data, const size_t size ) {
+		if( _is_zerocopy && size >= zerocopy_threshold )
+			_reference( data, size );
+		else
+			_write( data, size );
+	}
+	// Size prefix patched in once the value is written
+	struct _sized {
+		std::streampos	start;
+		size_t			segments;
+	};
+	_sized _begin_sized() {
+		_sized sized_;
+		sized_.start = _buffer.tellp();
+		sized_.segments = _segments.size();
+		size_t size_ = 0;
+		_write(	reinterpret_cast<const char*>( &size_ ),
+				sizeof( size_t ) );
+		return( sized_ );
+	}
+	void _end_sized( const _sized& sized ) {
+		std::streampos end_ = _buffer.tellp();
+		size_t size_ = static_cast<size_t>( end_ - sized.start )
+						- sizeof( size_t );
+		for( size_t i = sized.segments; i < _segments.size(); ++i )
+			size_ += _segments[i].size;
+		_buffer.seekp( sized.start );
+		_buffer.write(	reinterpret_cast<const char*>( &size_ ),
+						sizeof( size_t ) );
+		_buffer.seekp( end_ );
+	}
+	template<typename S, typename... F, size_t... I>
+	void _write_columns( const std::vector<S>& data,
+						 const std::tuple<F S::*...>& fields,
+						 std::index_sequence<I...> ) {
+		int expand_[] = { 0, ( _write_column( data, std::get<I>( fields ),
+								std::integral_constant<bool,
+									ntsbulk<F>::value>() ), 0 )... };
+		(void)expand_;
+	}
+	template<typename S, typename F>
+	void _write_column( const std::vector<S>& data, F S::* field,
+						std::true_type ) {
+		size_t bytes_ = data.size() * sizeof( F );
+		_write(	reinterpret_cast<const char*>( &bytes_ ),
+				sizeof( size_t ) );
+		std::vector<F> column_( data.size() );
+		for( size_t i = 0; i < data.size(); ++i )
+			column_[i] = data[i].*field;
+		_write( reinterpret_cast<const char*>( column_.data() ), bytes_ );
+	}
+	template<typename S, typename F>
+	void _write_column( const std::vector<S>& data, F S::* field,
+						std::false_type ) {
+		_sized sized_ = _begin_sized();
+		for( const S& row_ : data )
+			*this << row_.*field;
+		_end_sized( sized_ );
+	}
+	template<typename S, typename... F, size_t... I>
+	void _read_columns( std::vector<S>& data,
+						const std::tuple<F S::*...>& fields,
+						std::index_sequence<I...> ) {
+		int expand_[] = { 0, ( _read_column( data, std::get<I>( fields ),
+								std::integral_constant<bool,
+									ntsbulk<F>::value>() ), 0 )... };
+		(void)expand_;
+	}
+	template<typename S, typename F>
+	void _read_column( std::vector<S>& data, F S::* field,
+					   std::true_type ) {
+		if( _read_size() != data.size() * sizeof( F ) ) {
+			_fail( ntserror::corrupt );
+			return;
+		}
+		std::vector<F> column_( data.size() );
+		_read( reinterpret_cast<char*>( column_.data() ),
+			   column_.size() * sizeof( F ) );
+		for( size_t i = 0; i < data.size(); ++i )
+			data[i].*field = column_[i];
+	}
+	template<typename S, typename F>
+	void _read_column( std::vector<S>& data, F S::* field,
+					   std::false_type ) {
+		_read_size();
+		for( S& row_ : data )
+			*this >> row_.*field;
+	}
+	// Decode a value at offset, keeping the current read position. A
+	// failed decode fails the stream, false then.
+	template<typename T>
+	bool _decode_at( const size_t offset, T& value ) {
+		std::ios::iostate state_ = _buffer.rdstate();
+		_buffer.clear();
+		std::streampos pos_ = _buffer.tellg();
+		_buffer.seekg( static_cast<std::streamoff>( offset ) );
+		bool dedup_ = _is_dedup;
+		_is_dedup = false;
+		{
+			_pointer_scope scope_( *this );
+			*this >> value;
+		}
+		_is_dedup = dedup_;
+		const bool ok_ = !_buffer.fail() && pos_ != std::streampos( -1 );
+		_buffer.clear();
+		_buffer.seekg( pos_ );
+		_buffer.clear( state_ );
+		if( !ok_ )
+			_fail( ntserror::truncated );
+		return( ok_ );
+	}
+	void _skip( std::string* ) {
+		// Back-references find their string by offset, so skipped
+		// strings needn't enter the decode table
+		if( _is_dedup ) {
+			size_t header_ = _read_varint();
+			if( ( header_ & 1 ) == 0 )
+				_seek( header_ >> 1 );
+			return;
+		}
+		_seek( _read_size() );
+	}
+	template<typename T>
+	void _skip( std::vector<T>* ) {
+		size_t size_ = _read_size();
+		if( _is_floatxor && ntsxor<T>::value )
+			_seek( _read_size() );
+		else if( _is_rle && ntsbulk<T>::value
+				 && !std::is_same<T, bool>::value )
+			_skip_bulk( size_, sizeof( T ) );
+		else if( _is_flat && ntsflatten<T>::value )
+			_skip_flat<T>( size_, ntsflatten<T>() );
+		else
+			_skip_elements<T>( size_ );
+	}
+	template<typename T>
+	void _skip( std::deque<T>* ) {
+		size_t size_ = _read_size();
+		if( _is_floatxor && ntsxor<T>::value )
+			_seek( _read_size() );
+		else
+			_skip_elements<T>( size_ );
+	}
+	template<typename T>
+	void _skip( std::forward_list<T>* ) {
+		_skip_elements<T>( _read_size() );
+	}
+	template<typename T>
+	void _skip( std::list<T>* ) {
+		_skip_elements<T>( _read_size() );
+	}
+	template<typename T, typename C>
+	void _skip( std::queue<T, C>* ) {
+		_skip_elements<T>( _read_size() );
+	}
+	template<typename T, typename C, typename P>
+	void _skip( std::priority_queue<T, C, P>* ) {
+		_skip_elements<T>( _read_size() );
+	}
+	template<typename T, typename C>
+	void _skip( std::stack<T, C>* ) {
+		_skip_elements<T>( _read_size() );
+	}
+	template<typename T, size_t N>
+	void _skip( std::array<T, N>* ) {
+		if( _is_rle && ntsbulk<T>::value )
+			_skip_bulk( N, sizeof( T ) );
+		else
+			_skip_elements<T>( N );
+	}
+	template<typename T, size_t N>
+	void _skip( T (*)[N] ) {
+		if( _is_rle && ntsbulk<T>::value )
+			_skip_bulk( N, sizeof( T ) );
+		else
+			_skip_elements<T>( N );
+	}
+	template<typename T>
+	void _skip( std::set<T>* ) {
+		size_t size_ = _read_size();
+		if( _is_packkeys && ntspacked<T>::value )
+			_skip_packed( size_ );
+		else
+			_skip_elements<T>( size_ );
+	}
+	template<typename T>
+	void _skip( std::multiset<T>* ) {
+		size_t size_ = _read_size();
+		if( _is_packkeys && ntspacked<T>::value )
+			_skip_packed( size_ );
+		else
+			_skip_elements<T>( size_ );
+	}
+	template<typename T>
+	void _skip( std::unordered_set<T>* ) {
+		_skip_elements<T>( _read_size() );
+	}
+	template<typename T>
+	void _skip( std::unordered_multiset<T>* ) {
+		_skip_elements<T>( _read_size() );
+	}
+	template<typename T>
+	void _skip( ntsflat<T>* ) {
+		_skip_flat<std::vector<T>>( _read_size(), std::true_type() );
+	}
+	template<typename T1, typename T2, typename P>
+	void _skip_entries( const size_t count, P ) {
+		const bool flat_ = _is_flat && ntsflatten<T2>::value;
+		if( _is_packkeys && P::value )
+			_skip_packed( count );
+		else if( flat_ )
+			_skip_elements<T1>( count );
+		else
+			_skip_elements<std::pair<T1, T2>>( count );
+		if( flat_ )
+			_skip_flat<T2>( count, ntsflatten<T2>() );
+		else if( _is_packkeys && P::value )
+			_skip_elements<T2>( count );
+	}
+	template<typename T1, typename T2>
+	void _skip( std::pair<T1, T2>* ) {
+		_skip( static_cast<T1*>( nullptr ) );
+		_skip( static_cast<T2*>( nullptr ) );
+	}
+	template<typename T1, typename T2>
+	void _skip( std::map<T1, T2>* ) {
+		_skip_entries<T1, T2>( _read_size(), ntspacked<T1>() );
+	}
+	template<typename T1, typename T2>
+	void _skip( std::multimap<T1, T2>* ) {
+		_skip_entries<T1, T2>( _read_size(), ntspacked<T1>() );
+	}
+	template<typename T1, typename T2>
+	void _skip( std::unordered_map<T1, T2>* ) {
+		_skip_entries<T1, T2>( _read_size(), std::false_type() );
+	}
+	template<typename T1, typename T2>
+	void _skip( std::unordered_multimap<T1, T2>* ) {
+		_skip_entries<T1, T2>( _read_size(), std::false_type() );
+	}
+	// Shared pointers take the generic path, decoding puts new objects
+	// into the id table
+	template<typename T, typename D>
+	void _skip( std::unique_ptr<T, D>* ) {
+		if( _read_flag() )
+			_skip( static_cast<T*>( nullptr ) );
+	}
+	// Record a payload to be written by save() at the current position
+	void _reference( const char* data, const size_t size ) {
+		// Only the internal buffer is saved with its segments
+		if( attached() ) {
+			_write( data, size );
+			return;
+		}
+		_segment segment_;
+		segment_.offset = static_cast<size_t>( _buffer.tellp() );
+		segment_.data = data;
+		segment_.size = size;
+		_segments.push_back( segment_ );
+		if( _is_metrics ) {
+			_metrics.bytes_written += size;
+			_metrics.types[static_cast<size_t>( _type )].bytes_written
+				+= size;
+		}
+	}
+	// Copy the referenced payloads into the internal buffer, for every
+	// use of the data but save()
+	void _splice() {
+		if( _segments.empty() )
+			return;
+		std::streambuf* sb_ = _stream->rdbuf();
+		const std::string framing_ = _stream->str();
+		const size_t get_ = static_cast<size_t>(
+			sb_->pubseekoff( 0, std::ios::cur, std::ios::in ) );
+		size_t total_ = framing_.size();
+		for( const _segment& segment_ : _segments )
+			total_ += segment_.size;
+		std::string data_;
+		data_.reserve( total_ );
+		size_t offset_ = 0;
+		size_t shift_ = 0;
+		for( const _segment& segment_ : _segments ) {
+			data_.append( framing_, offset_, segment_.offset - offset_ );
+			data_.append( segment_.data, segment_.size );
+			if( segment_.offset <= get_ )
+				shift_ += segment_.size;
+			offset_ = segment_.offset;
+		}
+		data_.append( framing_, offset_, std::string::npos );
+		_segments.clear();
+		_stream->str( data_ );
+		sb_->pubseekoff( 0, std::ios::end, std::ios::out );
+		sb_->pubseekpos( get_ + shift_, std::ios::in );
+	}
+	// Interleave the framing in _buffer with the referenced payloads
+	bool _save_segments( const char* filename ) {
+		const std::string framing_ = _buffer.str();
+		std::vector<std::pair<const char*, size_t>> pieces_;
+		size_t offset_ = 0;
+		for( const _segment& segment_ : _segments ) {
+			if( segment_.offset > offset_ )
+				pieces_.emplace_back( framing_.data() + offset_,
+									  segment_.offset - offset_ );
+			pieces_.emplace_back( segment_.data, segment_.size );
+			offset_ = segment_.offset;
+		}
+		if( framing_.size() > offset_ )
+			pieces_.emplace_back( framing_.data() + offset_,
+								  framing_.size() - offset_ );
+#if defined( __unix__ ) || defined( __APPLE__ )
+		int fd_ = ::open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		if( fd_ < 0 )
+			return( false );
+		std::vector<iovec> iov_( pieces_.size() );
+		for( size_t i = 0; i < pieces_.size(); ++i ) {
+			iov_[i].iov_base = const_cast<char*>( pieces_[i].first );
+			iov_[i].iov_len = pieces_[i].second;
+		}
+		bool good_ = true;
+		for( size_t i = 0; good_ && i < iov_.size(); ) {
+			int count_ = static_cast<int>(
+				std::min<size_t>( iov_.size() - i, IOV_MAX ) );
+			ssize_t written_ = ::writev( fd_, &iov_[i], count_ );
+			if( written_ < 0 ) {
+				good_ = ( errno == EINTR );
+				continue;
+			}
+			// Skip what was written, resume inside a partial vector
+			size_t left_ = static_cast<size_t>( written_ );
+			while( i < iov_.size() && left_ >= iov_[i].iov_len )
+				left_ -= iov_[i++].iov_len;
+			if( left_ > 0 ) {
+				iov_[i].iov_base = static_cast<char*>( iov_[i].iov_base )
+									+ left_;
+				iov_[i].iov_len -= left_;
+			}
+		}
+		return( ::close( fd_ ) == 0 && good_ );
+#else
+		std::ofstream ofs_( filename,
+							std::ofstream::out | std::ofstream::trunc
+							| std::ifstream::binary );
+		if( !ofs_.is_open() )
+			return( false );
+		for( const auto& piece_ : pieces_ )
+			ofs_.write( piece_.first, piece_.second );
+		ofs_.close();
+		return( ofs_.good() );
+#endif
+	}
+	void _read( char* data, const size_t size ) {
+		_splice();
+		_buffer.read( data, size );
+		if( _buffer.gcount() != static_cast<std::streamsize>( size ) )
+			_fail( ntserror::truncated );
+		if( _is_metrics ) {
+			_metrics.bytes_read += size;
+			_metrics.types[static_cast<size_t>( _type )].bytes_read
+				+= size;
+		}
+	}
+	
+	std::unique_ptr<std::stringstream>	_stream;
+	std::stringstream&	_buffer;
+	bool _is_debug{false};
+	bool _is_metrics{false};
+	bool _is_zerocopy{false};
+	bool _is_dedup{false};
+	bool _is_packkeys{false};
+	bool _is_floatxor{false};
+	bool _is_rle{false};
+	bool _is_flat{false};
+	ntstype _type{ntstype::scalar};
+	ntslimits _limits;
+	ntserror _error{ntserror::none};
+	size_t _decoded{0};		// Bytes of elements admitted so far
+	size_t _depth{0};
+	ntsmetrics _metrics;
+	struct _segment {
+		size_t		offset;	// Position in _buffer
+		const char*	data;
+		size_t		size;
+	};
+	std::vector<_segment> _segments;
+	std::unordered_map<std::string, size_t> _strings_out;	// Offsets
+	std::unordered_map<size_t, std::string> _strings_in;
+	_pointers_map _pointers_out;
+	std::vector<std::shared_ptr<const void>> _pointers_held;
+	_pointers_list _pointers_in;
+	ntsimage _image;	// Kept alive while a cursor reads it
+	ntsmembuf _view;
+	std::mutex& _console_mtx;
+}; // class NTSerialize
+
+// Member decoded on first access. Loading only records the offset and
+// size of the encoded value, the NTSerialize it was read from must
+// outlive the first access.
+template<typename T>
+class ntslazy {
+public:
+	T& get() {
+		if( !_loaded ) {
+			if( _source == nullptr
+				|| _source->_decode_at( _offset, _value ) ) {
+				_loaded = true;
+			} else {
+				// Nothing half-decoded is handed out
+				_value = T();
+			}
+		}
+		return( _value );
+	}
+	const T& get() const {
+		return( const_cast<ntslazy*>( this )->get() );
+	}
+	T& operator*() {
+		return( get() );
+	}
+	T* operator->() {
+		return( &get() );
+	}
+	bool loaded() const {
+		return( _loaded );
+	}
+	// Position and size of the encoded value in the source
+	size_t offset() const {
+		return( _offset );
+	}
+	size_t size() const {
+		return( _size );
+	}
+	
+	ntslazy() {
+		
+	}
+	ntslazy( const T& value ) : _value( value ), _loaded( true ) {
+		
+	}
+
+private:
+	friend class NTSerialize;
+	
+	T				_value{};
+	NTSerialize*	_source{nullptr};
+	size_t			_offset{0};
+	size_t			_size{0};
+	bool			_loaded{true};
+}; // class ntslazy
+
+// Sequence of variable-length runs of raw values stored as one array
+// and count + 1 offsets into it. Decoding is two bulk copies and run i
+// is [data( i ), data( i ) + size( i )).
+template<typename T>
+class ntsflat {
+public:
+	static_assert( ntsbulk<T>::value, "ntsflat holds raw types only" );
+	
+	size_t size() const {
+		return( _offsets.size() - 1 );
+	}
+	bool empty() const {
+		return( size() == 0 );
+	}
+	size_t size( const size_t i ) const {
+		return( _offsets[i + 1] - _offsets[i] );
+	}
+	T* data( const size_t i ) {
+		return( _values.data() + _offsets[i] );
+	}
+	const T* data( const size_t i ) const {
+		return( _values.data() + _offsets[i] );
+	}
+	const T* begin( const size_t i ) const {
+		return( data( i ) );
+	}
+	const T* end( const size_t i ) const {
+		return( data( i ) + size( i ) );
+	}
+	void push_back( const T* data, const size_t count ) {
+		_values.insert( _values.end(), data, data + count );
+		_offsets.push_back( _values.size() );
+	}
+	template<typename C>
+	void push_back( const C& run ) {
+		push_back( run.data(), run.size() );
+	}
+	void clear() {
+		_offsets.assign( 1, 0 );
+		_values.clear();
+	}
+	// All runs back to back, and where each of them starts
+	const std::vector<T>& values() const {
+		return( _values );
+	}
+	const std::vector<size_t>& offsets() const {
+		return( _offsets );
+	}
+	
+	ntsflat() : _offsets( 1, 0 ) {
+		
+	}
+
+private:
+	friend class NTSerialize;
+	
+	std::vector<size_t>	_offsets;
+	std::vector<T>		_values;
+}; // class ntsflat
+
+// Shared fixed-size buffer for concurrent appends of length-framed
+// records. Producers reserve space with fetch_add and copy in parallel,
+// then mark their frame complete. commit() publishes the complete
+// prefix, so a slow producer only holds back the frames after its own.
+class NTSConcurrentWriter {
+public:
+	// Append an encoded record, false if the buffer is full
+	bool append( NTSerialize& record ) {
+		size_t size_ = record.size();
+		char* slot_ = _reserve( size_ );
+		if( slot_ != nullptr ) {
+			std::streambuf* sb_ = record.get().std::ios::rdbuf();
+			sb_->pubseekpos( 0, std::ios::in );
+			sb_->sgetn( slot_, static_cast<std::streamsize>( size_ ) );
+			_complete( slot_ );
+		}
+		return( slot_ != nullptr );
+	}
+	bool append( const char* data, const size_t size ) {
+		char* slot_ = _reserve( size );
+		if( slot_ != nullptr ) {
+			std::memcpy( slot_, data, size );
+			_complete( slot_ );
+		}
+		return( slot_ != nullptr );
+	}
+	// Publish the records completed so far up to the first one still
+	// being copied, false while appends reserved before the call are
+	// in flight
+	bool commit() {
+		const size_t reserved_ = _reserved.load( std::memory_order_acquire );
+		const size_t limit_ = _limit.load( std::memory_order_acquire );
+		size_t published_ = _published.load( std::memory_order_acquire );
+		size_t end_ = published_;
+		while( end_ < limit_ && _completed( end_ ) ) {
+			size_t size_ = 0;
+			std::memcpy( &size_, _data.get() + end_, sizeof( size_t ) );
+			end_ += sizeof( size_t ) + size_;
+		}
+		// Only move forward, a concurrent commit may have got further
+		while( end_ > published_
+			   && !_published.compare_exchange_weak(
+							published_, end_, std::memory_order_release,
+							std::memory_order_acquire ) ) {
+		}
+		return( end_ >= ( reserved_ < limit_ ? reserved_ : limit_ ) );
+	}
+	// Walk the published records: fn( const char* data, size_t size )
+	template<typename F>
+	size_t for_each( F fn ) const {
+		size_t end_ = _published.load( std::memory_order_acquire );
+		size_t count_ = 0;
+		for( size_t offset_ = 0; offset_ < end_; ++count_ ) {
+			size_t size_ = 0;
+			std::memcpy( &size_, _data.get() + offset_, sizeof( size_t ) );
+			offset_ += sizeof( size_t );
+			fn( const_cast<const char*>( _data.get() + offset_ ), size_ );
+			offset_ += size_;
+		}
+		return( count_ );
+	}
+	// Published bytes, the framed records can be saved as they are
+	const char* data() const {
+		return( _data.get() );
+	}
+	size_t size() const {
+		return( _published.load( std::memory_order_acquire ) );
+	}
+	bool full() const {
+		return( _limit.load( std::memory_order_relaxed ) != _capacity );
+	}
+	// Reset, producers must be stopped
+	void clear() {
+		for( size_t i = 0; i < _words(); ++i )
+			_done[i].store( 0, std::memory_order_relaxed );
+		_reserved.store( 0, std::memory_order_relaxed );
+		_published.store( 0, std::memory_order_relaxed );
+		_limit.store( _capacity, std::memory_order_relaxed );
+	}
+	
+	NTSConcurrentWriter( const size_t capacity )
+		: _data( new char[capacity] ), _capacity( capacity ),
+		  _done( new std::atomic<uint64_t>[_words()]() ),
+		  _limit( capacity ) {
+		
+	}
+	~NTSConcurrentWriter() {
+		
+	}
+
+private:
+	// Reserve a frame and write its header, nullptr if it doesn't fit
+	char* _reserve( const size_t size ) {
+		const size_t frame_ = sizeof( size_t ) + size;
+		const size_t offset_ =
+			_reserved.fetch_add( frame_, std::memory_order_relaxed );
+		if( offset_ + frame_ > _capacity ) {
+			// Everything from the first failed frame on is unusable
+			size_t limit_ = _limit.load( std::memory_order_relaxed );
+			while( offset_ < limit_
+				   && !_limit.compare_exchange_weak(
+								limit_, offset_,
+								std::memory_order_relaxed ) ) {
+			}
+			return( nullptr );
+		}
+		std::memcpy( _data.get() + offset_, &size, sizeof( size_t ) );
+		return( _data.get() + offset_ + sizeof( size_t ) );
+	}
+	// One completion bit per 8 bytes: frames are at least a header
+	// long, so no two frames start in the same 8 bytes
+	size_t _words() const {
+		return( ( _capacity / sizeof( size_t ) + 63 ) / 64 );
+	}
+	void _complete( const char* slot ) {
+		const size_t bit_ = static_cast<size_t>(
+			slot - sizeof( size_t ) - _data.get() ) / sizeof( size_t );
+		_done[bit_ / 64].fetch_or( uint64_t( 1 ) << ( bit_ % 64 ),
+								   std::memory_order_release );
+	}
+	bool _completed( const size_t offset ) const {
+		const size_t bit_ = offset / sizeof( size_t );
+		return( ( _done[bit_ / 64].load( std::memory_order_acquire )
+				  >> ( bit_ % 64 ) ) & 1 );
+	}
+	
+	std::unique_ptr<char[]>	_data;
+	const size_t			_capacity;
+	std::unique_ptr<std::atomic<uint64_t>[]>	_done;	// Per frame
+	std::atomic<size_t>		_reserved{0};
+	std::atomic<size_t>		_published{0};
+	std::atomic<size_t>		_limit;
+}; // class NTSConcurrentWriter
+
+// Resumable decoder for length-framed records, as NTSConcurrentWriter
+// lays them out, that arrive in pieces from non-blocking pipes and
+// sockets. Bytes are fed as they come and next() hands out every
+// complete record. A frame header is parsed once, later bytes are only
+// appended, so nothing is parsed again when a read comes up short.
+class NTSFrameDecoder {
+public:
+	// Append received bytes
+	void feed( const char* data, const size_t size ) {
+		_reserve( size );
+		std::memcpy( _data.get() + _end, data, size );
+		_end += size;
+	}
+#if defined( __unix__ ) || defined( __APPLE__ )
+	// Read what a non-blocking fd has, up to max_bytes so a fast
+	// sender can't starve the caller's other fds, like read(2): the
+	// bytes read, 0 at the end of the stream, -1 with errno set (EAGAIN
+	// if nothing was available). With edge-triggered polling, call
+	// again until it fails with EAGAIN.
+	ssize_t feed( const int fd, const size_t max_bytes = read_chunk ) {
+		ssize_t total_ = 0;
+		while( static_cast<size_t>( total_ ) < max_bytes ) {
+			const size_t left_ = max_bytes - static_cast<size_t>( total_ );
+			const size_t want_ = left_ < read_chunk ? left_ : read_chunk;
+			_reserve( want_ );
+			ssize_t read_ = ::read( fd, _data.get() + _end, want_ );
+			if( read_ > 0 ) {
+				_end += static_cast<size_t>( read_ );
+				total_ += read_;
+			} else if( read_ < 0 && errno == EINTR ) {
+				continue;
+			} else if( read_ < 0 && total_ > 0
+					   && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+				return( total_ );
+			} else {
+				return( total_ > 0 ? total_ : read_ );
+			}
+		}
+		return( total_ );
+	}
+#endif
+	// Move the next complete record into message and rewind it for
+	// reading, false until one has fully arrived
+	bool next( NTSerialize& message ) {
+		if( _failed )
+			return( false );
+		if( !_header ) {
+			if( _end - _begin < sizeof( size_t ) )
+				return( false );
+			std::memcpy( &_frame, _data.get() + _begin, sizeof( size_t ) );
+			_begin += sizeof( size_t );
+			_header = true;
+			if( _frame > _max_frame ) {
+				_failed = true;
+				return( false );
+			}
+		}
+		if( _end - _begin < _frame )
+			return( false );
+		message.clear();
+		message.get().write( _data.get() + _begin,
+							 static_cast<std::streamsize>( _frame ) );
+		_begin += _frame;
+		_header = false;
+		++_count;
+		return( true );
+	}
+	// A frame header was over max_frame, the stream can't be resynced
+	bool failed() const {
+		return( _failed );
+	}
+	// Records handed out and bytes waiting for the next one
+	size_t count() const {
+		return( _count );
+	}
+	size_t pending() const {
+		return( _end - _begin );
+	}
+	void clear() {
+		_begin = 0;
+		_end = 0;
+		_header = false;
+		_failed = false;
+	}
+	
+	// Bytes asked from the fd per read
+	static const size_t read_chunk = 64 * 1024;
+	static const size_t default_max_frame = static_cast<size_t>( 1 ) << 30;
+	
+	NTSFrameDecoder( const size_t max_frame = default_max_frame )
+		: _max_frame( max_frame ) {
+		
+	}
+	~NTSFrameDecoder() {
+		
+	}
+
+private:
+	// Make room for size more bytes, consumed bytes are dropped first
+	void _reserve( const size_t size ) {
+		if( _capacity - _end >= size )
+			return;
+		size_t used_ = _end - _begin;
+		if( used_ + size <= _capacity && _begin >= _capacity / 2 ) {
+			std::memmove( _data.get(), _data.get() + _begin, used_ );
+		} else {
+			size_t capacity_ = _capacity != 0 ? _capacity : read_chunk;
+			while( capacity_ < used_ + size )
+				capacity_ *= 2;
+			std::unique_ptr<char[]> data_( new char[capacity_] );
+			if( used_ != 0 )
+				std::memcpy( data_.get(), _data.get() + _begin, used_ );
+			_data = std::move( data_ );
+			_capacity = capacity_;
+		}
+		_begin = 0;
+		_end = used_;
+	}
+	
+	std::unique_ptr<char[]>	_data;
+	size_t					_capacity{0};
+	size_t					_begin{0};	// First unconsumed byte
+	size_t					_end{0};
+	size_t					_frame{0};	// Size of the current record
+	bool					_header{false};
+	bool					_failed{false};
+	size_t					_count{0};
+	const size_t			_max_frame;
+}; // class NTSFrameDecoder
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+// Single-producer single-consumer ring of length-framed records in
+// shared memory. The producer encodes straight into the ring and the
+// consumer decodes records where they are, no copies in between. A
+// record never wraps: if it doesn't fit before the end, a marker sends
+// the consumer back to offset 0. Waiters sleep on a futex on Linux and
+// poll elsewhere.
+class NTSRing {
+public:
+	// Create a named ring (shm_open) or an anonymous one shared with
+	// children forked afterwards, the capacity is rounded up to a power
+	// of two. open() maps a named ring created elsewhere.
+	bool create( const char* name, const size_t capacity ) {
+		close();
+		int fd_ = ::shm_open( name, O_CREAT | O_RDWR, 0600 );
+		if( fd_ < 0 )
+			return( false );
+		const size_t capacity_ = _round( capacity );
+		bool ok_ = ::ftruncate( fd_, static_cast<off_t>(
+									sizeof( _header ) + capacity_ ) ) == 0
+				   && _map( fd_, sizeof( _header ) + capacity_ );
+		::close( fd_ );
+		if( ok_ )
+			_init( capacity_ );
+		return( ok_ );
+	}
+	bool open( const char* name ) {
+		close();
+		int fd_ = ::shm_open( name, O_RDWR, 0600 );
+		if( fd_ < 0 )
+			return( false );
+		struct stat stat_;
+		bool ok_ = ::fstat( fd_, &stat_ ) == 0
+				   && static_cast<size_t>( stat_.st_size )
+					  > sizeof( _header )
+				   && _map( fd_, static_cast<size_t>( stat_.st_size ) );
+		::close( fd_ );
+		// The capacity must be one create() could have written
+		if( ok_ ) {
+			const size_t capacity_ = _ring->capacity;
+			if( _ring->magic.load( std::memory_order_acquire ) != _magic
+				|| capacity_ < _round( 0 )
+				|| ( capacity_ & ( capacity_ - 1 ) ) != 0
+				|| sizeof( _header ) + capacity_ != _size ) {
+				close();
+				ok_ = false;
+			} else {
+				_capacity = capacity_;
+			}
+		}
+		return( ok_ );
+	}
+	bool anonymous( const size_t capacity ) {
+		close();
+		const size_t capacity_ = _round( capacity );
+		if( !_map( -1, sizeof( _header ) + capacity_ ) )
+			return( false );
+		_init( capacity_ );
+		return( true );
+	}
+	static bool unlink( const char* name ) {
+		return( ::shm_unlink( name ) == 0 );
+	}
+	bool is_open() const {
+		return( _ring != nullptr );
+	}
+	void close() {
+		if( _ring != nullptr )
+			::munmap( _ring, _size );
+		_ring = nullptr;
+		_size = 0;
+		_capacity = 0;
+		_corrupt = false;
+	}
+	
+	// Producer: attach message to room for a record of up to max_size
+	// bytes, waiting up to timeout_ms (-1 forever) for the consumer
+	bool begin( NTSerialize& message, const size_t max_size,
+				const int timeout_ms = -1 ) {
+		char* slot_ = _reserve( max_size, timeout_ms );
+		if( slot_ == nullptr )
+			return( false );
+		_out.reset( slot_, max_size, 0 );
+		message.attach( _out );
+		return( true );
+	}
+	// Publish the record encoded since begin(), false if it overflowed
+	bool commit( NTSerialize& message ) {
+		const bool ok_ = !message.get().fail();
+		message.detach();
+		if( ok_ )
+			_publish( _out.size() );
+		return( ok_ );
+	}
+	// Producer: copy an encoded record in
+	bool send( const char* data, const size_t size,
+			   const int timeout_ms = -1 ) {
+		char* slot_ = _reserve( size, timeout_ms );
+		if( slot_ == nullptr )
+			return( false );
+		std::memcpy( slot_, data, size );
+		_publish( size );
+		return( true );
+	}
+	
+	// Consumer: attach message to the next record, waiting up to
+	// timeout_ms (-1 forever) for it. A record that doesn't fit in the
+	// published bytes makes failed() true and is never handed out.
+	bool receive( NTSerialize& message, const int timeout_ms = -1 ) {
+		const size_t capacity_ = _capacity;
+		while( !_corrupt ) {
+			const uint64_t tail_ =
+				_ring->tail.load( std::memory_order_relaxed );
+			auto ready_ = [this, tail_]() {
+				return( _ring->head.load( std::memory_order_acquire )
+						!= tail_ );
+			};
+			if( !_wait( ready_, _ring->data_seq, _ring->consumer_waiting,
+						timeout_ms ) ) {
+				return( false );
+			}
+			const size_t offset_ =
+				static_cast<size_t>( tail_ & ( capacity_ - 1 ) );
+			const uint64_t published_ =
+				_ring->head.load( std::memory_order_acquire ) - tail_;
+			const size_t room_ = capacity_ - offset_ - sizeof( size_t );
+			size_t size_ = 0;
+			std::memcpy( &size_, _data() + offset_, sizeof( size_t ) );
+			if( size_ == _wrap ) {
+				// A wrap marker is followed by a record at offset 0
+				if( offset_ == 0 || published_ <= capacity_ - offset_ ) {
+					_corrupt = true;
+					break;
+				}
+				_release( tail_ + ( capacity_ - offset_ ) );
+				continue;
+			}
+			if( size_ > room_
+				|| published_ < sizeof( size_t ) + _align( size_ ) ) {
+				_corrupt = true;
+				break;
+			}
+			_in.reset( _data() + offset_ + sizeof( size_t ), size_, size_ );
+			_next = tail_ + sizeof( size_t ) + _align( size_ );
+			message.attach( _in );
+			return( true );
+		}
+		return( false );
+	}
+	// Hand the record back to the producer once it is decoded
+	void release( NTSerialize& message ) {
+		message.detach();
+		_release( _next );
+	}
+	
+	size_t capacity() const {
+		return( _capacity );
+	}
+	// The consumer found a malformed record, the ring can't be resynced
+	bool failed() const {
+		return( _corrupt );
+	}
+	
+	// Polls before going to sleep, a wakeup costs a few microseconds
+	static const unsigned int spin = 2000;
+	
+	NTSRing() {
+		
+	}
+	~NTSRing() {
+		close();
+	}
+	NTSRing( const NTSRing& ) = delete;
+	NTSRing& operator=( const NTSRing& ) = delete;
+
+private:
+	static const uint64_t _magic = 0x4e545352696e6701ull;
+	static const size_t _wrap = SIZE_MAX;
+	
+	// Producer and consumer fields on their own cache lines
+	struct _header {
+		std::atomic<uint64_t> magic;
+		size_t capacity;
+		alignas( 64 ) std::atomic<uint64_t> head;
+		std::atomic<uint32_t> data_seq;
+		std::atomic<uint32_t> consumer_waiting;
+		alignas( 64 ) std::atomic<uint64_t> tail;
+		std::atomic<uint32_t> space_seq;
+		std::atomic<uint32_t> producer_waiting;
+		alignas( 64 ) char data[1];
+	};
+	
+	static size_t _round( const size_t capacity ) {
+		size_t capacity_ = 64;
+		while( capacity_ < capacity )
+			capacity_ *= 2;
+		return( capacity_ );
+	}
+	static size_t _align( const size_t size ) {
+		const size_t mask_ = sizeof( size_t ) - 1;
+		return( ( size + mask_ ) & ~mask_ );
+	}
+	bool _map( const int fd, const size_t size ) {
+		const int flags_ = fd < 0 ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED;
+		void* map_ = ::mmap( nullptr, size, PROT_READ | PROT_WRITE,
+							 flags_, fd, 0 );
+		if( map_ == MAP_FAILED )
+			return( false );
+		_ring = static_cast<_header*>( map_ );
+		_size = size;
+		return( true );
+	}
+	void _init( const size_t capacity ) {
+		new( _ring ) _header;
+		_ring->capacity = capacity;
+		_capacity = capacity;
+		_ring->head.store( 0, std::memory_order_relaxed );
+		_ring->tail.store( 0, std::memory_order_relaxed );
+		_ring->data_seq.store( 0, std::memory_order_relaxed );
+		_ring->space_seq.store( 0, std::memory_order_relaxed );
+		_ring->consumer_waiting.store( 0, std::memory_order_relaxed );
+		_ring->producer_waiting.store( 0, std::memory_order_relaxed );
+		_ring->magic.store( _magic, std::memory_order_release );
+	}
+	char* _data() {
+		return( _ring->data );
+	}
+	// Wait for room and return where the record's payload goes. If it
+	// doesn't fit before the end, the rest of the ring is skipped.
+	char* _reserve( const size_t max_size, const int timeout_ms ) {
+		const size_t capacity_ = _capacity;
+		const size_t need_ = sizeof( size_t ) + _align( max_size );
+		if( need_ > capacity_ )
+			return( nullptr );
+		const uint64_t head_ =
+			_ring->head.load( std::memory_order_relaxed );
+		const size_t offset_ =
+			static_cast<size_t>( head_ & ( capacity_ - 1 ) );
+		const size_t skip_ = capacity_ - offset_ < need_
+							 ? capacity_ - offset_ : 0;
+		auto room_ = [this, head_, skip_, need_, capacity_]() {
+			return( head_ + skip_ + need_ - _ring->tail.load(
+						std::memory_order_acquire ) <= capacity_ );
+		};
+		if( !_wait( room_, _ring->space_seq, _ring->producer_waiting,
+					timeout_ms ) ) {
+			return( nullptr );
+		}
+		if( skip_ != 0 ) {
+			const size_t wrap_ = _wrap;
+			std::memcpy( _data() + offset_, &wrap_, sizeof( size_t ) );
+		}
+		_start = head_ + skip_;
+		return( _data() + ( _start & ( capacity_ - 1 ) )
+				+ sizeof( size_t ) );
+	}
+	void _publish( const size_t size ) {
+		std::memcpy( _data() + ( _start & ( _capacity - 1 ) ),
+					 &size, sizeof( size_t ) );
+		_ring->head.store( _start + sizeof( size_t ) + _align( size ),
+						   std::memory_order_release );
+		_notify( _ring->data_seq, _ring->consumer_waiting );
+	}
+	void _release( const uint64_t tail ) {
+		_ring->tail.store( tail, std::memory_order_release );
+		_notify( _ring->space_seq, _ring->producer_waiting );
+	}
+	// Bump the sequence after publishing, wake the other side if it
+	// announced that it sleeps. The flag is taken, so one wakeup is
+	// issued per sleep.
+	static void _notify( std::atomic<uint32_t>& seq,
+						 std::atomic<uint32_t>& waiting ) {
+		seq.fetch_add( 1, std::memory_order_seq_cst );
+		if( waiting.exchange( 0, std::memory_order_seq_cst ) != 0 ) {
+#if defined( __linux__ )
+			::syscall( SYS_futex, reinterpret_cast<uint32_t*>( &seq ),
+					   FUTEX_WAKE, 1, nullptr, nullptr, 0 );
+#endif
+		}
+	}
+	// Spin, then sleep on seq until ready() or the timeout. The
+	// sequence is read before ready() is checked again, so a notify in
+	// between changes it and the futex doesn't sleep.
+	template<typename F>
+	static bool _wait( F ready, std::atomic<uint32_t>& seq,
+					   std::atomic<uint32_t>& waiting,
+					   const int timeout_ms ) {
+		for( unsigned int i = 0; i < spin; ++i ) {
+			if( ready() )
+				return( true );
+		}
+		const auto deadline_ = std::chrono::steady_clock::now()
+							   + std::chrono::milliseconds( timeout_ms );
+		for( ;; ) {
+			waiting.store( 1, std::memory_order_seq_cst );
+			const uint32_t seq_ = seq.load( std::memory_order_seq_cst );
+			if( ready() ) {
+				waiting.store( 0, std::memory_order_relaxed );
+				return( true );
+			}
+			std::chrono::nanoseconds left_( 1000000 );
+			if( timeout_ms >= 0 ) {
+				left_ = deadline_ - std::chrono::steady_clock::now();
+				if( left_.count() <= 0 ) {
+					waiting.store( 0, std::memory_order_relaxed );
+					return( false );
+				}
+			}
+#if defined( __linux__ )
+			struct timespec ts_;
+			ts_.tv_sec = static_cast<time_t>( left_.count() / 1000000000 );
+			ts_.tv_nsec = static_cast<long>( left_.count() % 1000000000 );
+			::syscall( SYS_futex, reinterpret_cast<uint32_t*>( &seq ),
+					   FUTEX_WAIT, seq_, timeout_ms >= 0 ? &ts_ : nullptr,
+					   nullptr, 0 );
+#else
+			(void)seq_;
+			struct timespec ts_{ 0, 50000 };
+			::nanosleep( &ts_, nullptr );
+#endif
+		}
+	}
+	_header*						_ring{nullptr};
+	size_t							_size{0};
+	size_t							_capacity{0};	// Validated copy
+	bool							_corrupt{false};
+	ntsmembuf						_out;
+	ntsmembuf						_in;
+	uint64_t						_start{0};	// Record being encoded
+	uint64_t						_next{0};	// Tail after release()
+}; // class NTSRing
+
+// Background snapshot in the style of a fork-and-save: the child writes
+// the copy-on-write image of the parent's state straight to a file
+// while the parent carries on. The parent only pauses for fork(). The
+// child's private dirty memory is the copy-on-write overhead: pages
+// either side modified since the fork, plus the child's own buffers.
+class NTSSnapshot {
+public:
+	// Fork and run fn( NTSerialize& ) in the child, streaming into
+	// filename (through a temporary file renamed once complete). fn
+	// runs in a copy of a possibly multi-threaded process, so it must
+	// not take locks other threads might have held.
+	template<typename F>
+	bool start( const char* filename, F fn ) {
+		if( _pid > 0 || ::pipe( _pipe ) != 0 )
+			return( false );
+		_report = _result();
+		_peak = 0;
+		const auto start_ = std::chrono::steady_clock::now();
+		_pid = ::fork();
+		if( _pid == 0 ) {
+			::close( _pipe[0] );
+			_run( filename, fn );
+		}
+		_pause_us = static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - start_ ).count() );
+		::close( _pipe[1] );
+		if( _pid < 0 ) {
+			::close( _pipe[0] );
+			_pid = 0;
+			return( false );
+		}
+		return( true );
+	}
+	// True while the child is still writing
+	bool running() {
+		if( _pid <= 0 )
+			return( false );
+		int status_ = 0;
+		pid_t done_ = ::waitpid( _pid, &status_, WNOHANG );
+		if( done_ == 0 )
+			return( true );
+		_finish( done_ == _pid ? status_ : -1 );
+		return( false );
+	}
+	// Wait for the child, true if the snapshot was written
+	bool wait() {
+		if( _pid > 0 ) {
+			int status_ = 0;
+			pid_t done_;
+			do {
+				done_ = ::waitpid( _pid, &status_, 0 );
+			} while( done_ < 0 && errno == EINTR );
+			_finish( done_ == _pid ? status_ : -1 );
+		}
+		return( _report.ok != 0 );
+	}
+	// Result of the last finished snapshot
+	bool ok() const {
+		return( _report.ok != 0 );
+	}
+	size_t size() const {
+		return( static_cast<size_t>( _report.size ) );
+	}
+	// Copy-on-write bytes of the running child, sampled from /proc on
+	// Linux. The peak also takes the child's own final reading.
+	size_t cow_bytes() {
+		size_t bytes_ = _pid > 0 ? _private_dirty( _pid ) : 0;
+		_peak = std::max( _peak, bytes_ );
+		return( bytes_ );
+	}
+	size_t peak_cow_bytes() const {
+		return( std::max( _peak,
+						  static_cast<size_t>( _report.private_dirty ) ) );
+	}
+	// How long the parent was held up by fork()
+	uint64_t pause_us() const {
+		return( _pause_us );
+	}
+	
+	// Size of the child's file buffer
+	static const size_t write_buffer = 1 << 20;
+	
+	NTSSnapshot( std::mutex& mtx ) : _console_mtx( mtx ) {
+		
+	}
+	~NTSSnapshot() {
+		wait();
+	}
+	NTSSnapshot( const NTSSnapshot& ) = delete;
+	NTSSnapshot& operator=( const NTSSnapshot& ) = delete;
+
+private:
+	// Sent by the child through the pipe before it exits
+	struct _result {
+		uint64_t ok{0};
+		uint64_t size{0};
+		uint64_t private_dirty{0};
+	};
+	
+	// Everything runs under catch( ... ): an exception escaping into
+	// the parent's stack would resume the parent's code in the child
+	template<typename F>
+	void _run( const char* filename, F& fn ) {
+		_result result_;
+		std::string temp_ = std::string( filename ) + ".tmp";
+		try {
+			std::unique_ptr<char[]> buffer_( new char[write_buffer] );
+			std::filebuf file_;
+			file_.pubsetbuf( buffer_.get(), write_buffer );
+			const std::ios::openmode mode_ = std::ios::out
+											 | std::ios::trunc
+											 | std::ios::binary;
+			if( file_.open( temp_.c_str(), mode_ ) ) {
+				NTSerialize nts_( _console_mtx );
+				nts_.attach( file_ );
+				fn( nts_ );
+				bool written_ = !nts_.get().fail();
+				result_.size = static_cast<uint64_t>( nts_.size() );
+				nts_.detach();
+				result_.ok = file_.close() != nullptr && written_
+							 && _sync( temp_.c_str() )
+							 && std::rename( temp_.c_str(), filename ) == 0;
+			}
+		} catch( ... ) {
+			result_.ok = 0;
+		}
+		try {
+			if( result_.ok == 0 )
+				std::remove( temp_.c_str() );
+			result_.private_dirty = _private_dirty( ::getpid() );
+		} catch( ... ) {
+			
+		}
+		ssize_t sent_ = ::write( _pipe[1], &result_, sizeof( result_ ) );
+		::_exit( sent_ == static_cast<ssize_t>( sizeof( result_ ) )
+				 && result_.ok != 0 ? EXIT_SUCCESS : EXIT_FAILURE );
+	}
+	// Flush the closed file to disk, so the rename never publishes a
+	// file whose contents are still only in the page cache
+	static bool _sync( const char* filename ) {
+		int fd_ = ::open( filename, O_WRONLY );
+		if( fd_ < 0 )
+			return( false );
+		int synced_;
+		do {
+			synced_ = ::fsync( fd_ );
+		} while( synced_ != 0 && errno == EINTR );
+		::close( fd_ );
+		return( synced_ == 0 );
+	}
+	void _finish( const int status ) {
+		_result result_;
+		if( ::read( _pipe[0], &result_, sizeof( result_ ) )
+			!= static_cast<ssize_t>( sizeof( result_ ) ) ) {
+			result_ = _result();
+		}
+		if( status < 0 || !WIFEXITED( status )
+			|| WEXITSTATUS( status ) != EXIT_SUCCESS ) {
+			result_.ok = 0;
+		}
+		_report = result_;
+		::close( _pipe[0] );
+		_pid = 0;
+	}
+	// Private_Dirty of a process in bytes, 0 where /proc is missing
+	static size_t _private_dirty( const pid_t pid ) {
+		std::ifstream ifs_( "/proc/" + std::to_string( pid )
+							+ "/smaps_rollup" );
+		std::string key_;
+		size_t kb_ = 0;
+		while( ifs_ >> key_ ) {
+			if( key_ == "Private_Dirty:" ) {
+				ifs_ >> kb_;
+				return( kb_ * 1024 );
+			}
+			ifs_.ignore( std::numeric_limits<std::streamsize>::max(),
+						 '\n' );
+		}
+		return( 0 );
+	}
+	
+	pid_t		_pid{0};
+	int			_pipe[2]{-1, -1};
+	_result		_report;
+	size_t		_peak{0};
+	uint64_t	_pause_us{0};
+	std::mutex&	_console_mtx;
+}; // class NTSSnapshot
+#endif
 
 } // ntllct
 
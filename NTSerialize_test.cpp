@@ -1,9 +1,16 @@
 // Copyright (c) 2017 Alexander Alexeev [ntllct@protonmail.com] 
-// Compilation: g++ -std=c++14 -m64 -O2 NTSerialize_test.cpp -o NTStest
+// Compilation: g++ -std=c++14 -m64 -O2 -pthread NTSerialize_test.cpp -o NTStest
 
 #include "NTSerialize.hpp"
 #include <cstddef>
 #include <algorithm>
+#include <thread>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 using namespace ntllct;
 
@@ -31,6 +38,36 @@ struct TestStruct2 {
 	}
 };
 
+struct TestRow {
+	unsigned int id;
+	double price;
+	std::string name;
+	
+	bool operator==( const TestRow& row ) const {
+		return( id == row.id && price == row.price && name == row.name );
+	}
+};
+
+// Holds reads back until opened, to keep an append in flight
+class TestGateBuf : public ntsmembuf {
+public:
+	std::atomic<bool> entered{false};
+	std::atomic<bool> opened{false};
+	
+	TestGateBuf( char* data, const size_t size )
+		: ntsmembuf( data, size, size ) {
+		
+	}
+
+protected:
+	std::streamsize xsgetn( char* s, std::streamsize n ) override {
+		entered = true;
+		while( !opened )
+			std::this_thread::yield();
+		return( std::streambuf::xsgetn( s, n ) );
+	}
+};
+
 void test_easy() {
 	NTSerialize ser_out( console_mtx );
 	size_t val_out_ = 123;
@@ -247,6 +284,1174 @@ void test_unordered_multimap() {
 		std::cout << "test_unordered_multimap: error!" << std::endl;
 	}
 }
+void test_metrics() {
+	NTSerialize ser_out( console_mtx );
+	ser_out << ntsdirective::metrics;
+	std::vector<unsigned int> vec_out_{ 10, 20, 30 };
+	std::string text_out_ = "Some text...";
+	ser_out << vec_out_ << text_out_;
+	ser_out.save( "test_metrics.bin" );
+	ntsmetrics out_ = ser_out.metrics();
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in << ntsdirective::metrics;
+	ser_in.load( "test_metrics.bin" );
+	std::vector<unsigned int> vec_in_;
+	std::string text_in_;
+	ser_in >> vec_in_ >> text_in_;
+	ntsmetrics in_ = ser_in.metrics();
+	
+	size_t saves_ = 0;
+	size_t loads_ = 0;
+	for( size_t i = 0; i < out_.save_us.size(); ++i ) {
+		saves_ += out_.save_us[i];
+		loads_ += in_.load_us[i];
+	}
+	// Growths are measured: a cleared buffer keeps its storage
+	NTSerialize ser_grow( console_mtx );
+	ser_grow << ntsdirective::metrics;
+	std::string big_( 2 * NTSBufferPool::max_bytes, 'g' );
+	ser_grow << big_;
+	bool grown_ = ser_grow.metrics().buffer_growths >= 1;
+	ser_grow << ntsdirective::clear << ntsdirective::metrics << big_;
+	grown_ = grown_ && ser_grow.metrics().buffer_growths == 0;
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( out_.bytes_written == 8 + 3 * 4 + 8 + text_out_.size()
+		&& in_.bytes_read == out_.bytes_written
+		&& out_[ntstype::vector].calls == 1
+		&& out_[ntstype::vector].elements == 3
+		&& out_[ntstype::vector].bytes_written == 8 + 3 * 4
+		&& in_[ntstype::string].bytes_read == 8 + text_out_.size()
+		&& grown_
+		&& saves_ == 1 && loads_ == 1 ) {
+		
+		std::cout << "test_metrics: OK!" << std::endl;
+	} else {
+		std::cout << "test_metrics: error!" << std::endl;
+	}
+}
+void test_concurrent_writer() {
+	const unsigned int threads_ = 4;
+	const unsigned int records_ = 1000;
+	NTSConcurrentWriter writer_( 1 << 20 );
+	std::vector<std::thread> producers_;
+	for( unsigned int t = 0; t < threads_; ++t ) {
+		producers_.emplace_back( [&writer_, t, records_]() {
+			NTSerialize record_( console_mtx );
+			for( unsigned int i = 0; i < records_; ++i ) {
+				record_ << ntsdirective::clear;
+				record_ << t << i << std::string( i % 16, 'x' );
+				writer_.append( record_ );
+			}
+		} );
+	}
+	for( auto& producer_ : producers_ )
+		producer_.join();
+	bool committed_ = writer_.commit();
+	
+	// A slow producer holds back only the records after its own
+	NTSConcurrentWriter prefix_( 4096 );
+	prefix_.append( "a", 1 );
+	char slow_data_[] = "bb";
+	TestGateBuf gate_( slow_data_, 2 );
+	std::thread slow_( [&prefix_, &gate_]() {
+		NTSerialize record_( console_mtx );
+		record_.attach( gate_ );
+		prefix_.append( record_ );
+		record_.detach();
+	} );
+	while( !gate_.entered )
+		std::this_thread::yield();
+	prefix_.append( "c", 1 );
+	bool prefix_ok_ = !prefix_.commit()
+					  && prefix_.size() == sizeof( size_t ) + 1;
+	gate_.opened = true;
+	slow_.join();
+	prefix_ok_ = prefix_ok_ && prefix_.commit()
+				 && prefix_.size() == 3 * sizeof( size_t ) + 4
+				 && prefix_.for_each( []( const char*, size_t ) {} ) == 3;
+	
+	std::vector<unsigned int> next_( threads_, 0 );
+	bool ordered_ = true;
+	size_t count_ = writer_.for_each(
+		[&next_, &ordered_]( const char* data, size_t size ) {
+			NTSerialize record_( console_mtx );
+			record_.get().write( data, size );
+			unsigned int t = 0;
+			unsigned int i = 0;
+			std::string text_;
+			record_ >> t >> i >> text_;
+			if( t >= next_.size() || next_[t] != i
+				|| text_.size() != i % 16 )
+				ordered_ = false;
+			else
+				++next_[t];
+		} );
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( committed_ && prefix_ok_ && ordered_ && !writer_.full()
+		&& count_ == threads_ * records_ ) {
+		
+		std::cout << "test_concurrent_writer: OK!" << std::endl;
+	} else {
+		std::cout << "test_concurrent_writer: error!" << std::endl;
+	}
+}
+void test_buffer_pool() {
+	const std::stringstream* stream_ = nullptr;
+	{
+		NTSerialize ser_tmp( console_mtx );
+		ser_tmp << std::string( 1000, 'x' );
+		stream_ = &ser_tmp.get();
+	}
+	size_t pooled_ = NTSBufferPool::size();
+	
+	NTSerialize ser_out( console_mtx );
+	bool reused_ = &ser_out.get() == stream_;
+	unsigned int val_out_ = 42;
+	ser_out << val_out_;
+	size_t size_ = ser_out.size();
+	unsigned int val_in_ = 0;
+	ser_out >> val_in_;
+	
+	// Emptied after a large message, it still holds the storage and
+	// is freed rather than returned
+	size_t before_ = NTSBufferPool::size();
+	bool taken_ = before_ == pooled_ - 1;
+	{
+		NTSerialize ser_big( console_mtx );
+		ser_big << std::string( 2 * NTSBufferPool::max_bytes, 'x' );
+		ser_big << ntsdirective::clear;
+	}
+	bool bounded_ = NTSBufferPool::size() == before_ - 1;
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( pooled_ > 1 && reused_ && size_ == sizeof( val_out_ ) && taken_
+		&& bounded_
+		&& val_in_ == val_out_ ) {
+		
+		std::cout << "test_buffer_pool: OK!" << std::endl;
+	} else {
+		std::cout << "test_buffer_pool: error!" << std::endl;
+	}
+}
+void test_zerocopy() {
+	NTSerialize ser_out( console_mtx );
+	ser_out << ntsdirective::zerocopy;
+	std::string text_out_( NTSerialize::zerocopy_threshold, 'z' );
+	std::vector<double> vec_out_( NTSerialize::zerocopy_threshold );
+	for( size_t i = 0; i < vec_out_.size(); ++i )
+		vec_out_[i] = i * 0.5;
+	unsigned int val_out_ = 7;
+	ser_out << val_out_ << text_out_ << vec_out_ << val_out_;
+	size_t size_ = ser_out.size();
+	ser_out.save( "test_zerocopy.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in.load( "test_zerocopy.bin" );
+	unsigned int val_in1_ = 0;
+	unsigned int val_in2_ = 0;
+	std::string text_in_;
+	std::vector<double> vec_in_;
+	ser_in >> val_in1_ >> text_in_ >> vec_in_ >> val_in2_;
+	
+	// Without a file the payloads are copied in when the data is used
+	bool inline_ = ser_out.get().str().size() == size_
+				   && ser_out.image().size() == size_;
+	std::string text_back_;
+	std::vector<double> vec_back_;
+	ser_out << ntsdirective::clear << text_out_ << vec_out_;
+	ser_out >> text_back_ >> vec_back_;
+	inline_ = inline_ && text_back_ == text_out_ && vec_back_ == vec_out_;
+	std::vector<char> memory_( size_ );
+	ntsmembuf buffer_( memory_.data(), memory_.size(), 0 );
+	ser_out << ntsdirective::clear;
+	ser_out.attach( buffer_ ) << val_out_ << text_out_ << vec_out_
+							  << val_out_;
+	inline_ = inline_ && buffer_.size() == size_;
+	ser_out.detach();
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( size_ == 2 * sizeof( unsigned int ) + 2 * sizeof( size_t )
+				 + text_out_.size() + vec_out_.size() * sizeof( double )
+		&& val_in1_ == val_out_ && val_in2_ == val_out_
+		&& text_in_ == text_out_ && vec_in_ == vec_out_ && inline_ ) {
+		
+		std::cout << "test_zerocopy: OK!" << std::endl;
+	} else {
+		std::cout << "test_zerocopy: error!" << std::endl;
+	}
+}
+void test_skip() {
+	NTSerialize ser_out( console_mtx );
+	std::vector<std::vector<unsigned int>> nested_out_{ { 1, 2 }, { 3 } };
+	std::map<std::string, std::vector<double>> map_out_{
+												{ "a", { 1.0 } },
+												{ "bc", { 2.0, 3.0 } }
+											};
+	std::array<TestStruct1, 2> array_out_{ { { 1, 2 }, { 3, 4 } } };
+	TestStruct2 struct_out_;
+	struct_out_.x1 = 6;
+	struct_out_.x2 = 11;
+	unsigned int val_out_ = 77;
+	ser_out << nested_out_ << std::string( "skip me" ) << map_out_
+			<< array_out_ << struct_out_ << val_out_;
+	ser_out.save( "test_skip.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in.load( "test_skip.bin" );
+	ser_in.skip<std::vector<std::vector<unsigned int>>>()
+		  .skip<std::string>();
+	std::streampos map_pos_ = ser_in.pos();
+	ser_in.skip<std::map<std::string, std::vector<double>>>()
+		  .skip<std::array<TestStruct1, 2>>()
+		  .skip<TestStruct2>();
+	unsigned int val_in_ = 0;
+	ser_in >> val_in_;
+	
+	// pos() after skip<T>() matches pos() after decoding a T
+	ser_in.pos( static_cast<size_t>( map_pos_ ), std::ios::beg );
+	std::map<std::string, std::vector<double>> map_in_;
+	ser_in >> map_in_;
+	std::streampos decoded_pos_ = ser_in.pos();
+	ser_in.pos( static_cast<size_t>( map_pos_ ), std::ios::beg );
+	ser_in.skip<std::map<std::string, std::vector<double>>>();
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( val_in_ == val_out_ && map_in_ == map_out_
+		&& ser_in.pos() == decoded_pos_ ) {
+		
+		std::cout << "test_skip: OK!" << std::endl;
+	} else {
+		std::cout << "test_skip: error!" << std::endl;
+	}
+}
+void test_lazy() {
+	NTSerialize ser_out( console_mtx );
+	ntslazy<std::vector<unsigned int>> vec_out_(
+									std::vector<unsigned int>{ 1, 2, 3 } );
+	ntslazy<std::map<unsigned int, std::string>> map_out_(
+						std::map<unsigned int, std::string>{ { 1, "a" } } );
+	unsigned int val_out_ = 5;
+	ser_out << vec_out_ << map_out_ << val_out_;
+	ser_out.save( "test_lazy.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in.load( "test_lazy.bin" );
+	ntslazy<std::vector<unsigned int>> vec_in_;
+	ntslazy<std::map<unsigned int, std::string>> map_in_;
+	unsigned int val_in_ = 0;
+	ser_in >> vec_in_ >> map_in_ >> val_in_;
+	bool deferred_ = !vec_in_.loaded() && !map_in_.loaded();
+	
+	// A value that fails to decode stays unloaded and fails the source
+	NTSerialize ser_bad( console_mtx );
+	ser_bad << vec_out_ << val_out_;
+	ser_bad << ntsdirective::posstart
+			<< static_cast<size_t>( vec_in_.size() )
+			<< ( static_cast<size_t>( 1 ) << 40 );
+	ntslazy<std::vector<unsigned int>> bad_in_;
+	unsigned int after_in_ = 0;
+	ser_bad >> bad_in_ >> after_in_;
+	bool read_ = ser_bad.get().good() && after_in_ == val_out_;
+	bool failed_ = read_ && bad_in_->empty() && !bad_in_.loaded()
+				   && ser_bad.error() == ntserror::truncated;
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( deferred_ && failed_ && val_in_ == val_out_
+		&& vec_in_.size() == sizeof( size_t ) + 3 * sizeof( unsigned int )
+		&& map_in_->at( 1 ) == "a" && !vec_in_.loaded()
+		&& *vec_in_ == *vec_out_ ) {
+		
+		std::cout << "test_lazy: OK!" << std::endl;
+	} else {
+		std::cout << "test_lazy: error!" << std::endl;
+	}
+}
+void test_dedup() {
+	NTSerialize ser_out( console_mtx );
+	ser_out << ntsdirective::dedup;
+	std::multimap<std::string, std::string> mmap_out_;
+	for( unsigned int i = 0; i < 100; ++i )
+		mmap_out_.emplace( "key" + std::to_string( i % 4 ),
+						   "value" + std::to_string( i % 3 ) );
+	ser_out << mmap_out_;
+	size_t size_ = ser_out.size();
+	// A column that is skipped on read, then a repeat of one of its
+	// strings
+	auto columns_ = make_ntscolumns( &TestRow::id, &TestRow::name );
+	std::vector<TestRow> rows_out_;
+	for( unsigned int i = 0; i < 10; ++i )
+		rows_out_.push_back( { i, 0.0, std::string( i, 'n' ) } );
+	ser_out.write_columns( rows_out_, columns_ );
+	ser_out << std::string( 5, 'n' );
+	ser_out.save( "test_dedup.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in << ntsdirective::dedup;
+	ser_in.load( "test_dedup.bin" );
+	std::multimap<std::string, std::string> mmap_in_;
+	ser_in >> mmap_in_;
+	std::vector<unsigned int> ids_;
+	std::string skipped_in_;
+	ser_in.read_column<0>( ids_, columns_ ) >> skipped_in_;
+	// Reading again after a seek resolves to the same strings
+	std::multimap<std::string, std::string> again_in_;
+	ser_in.pos( 0, std::ios::beg );
+	ser_in >> again_in_;
+	
+	// 7 distinct strings in full with 1-byte lengths, 193
+	// back-references of 1 or 2 bytes
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( mmap_in_ == mmap_out_ && again_in_ == mmap_out_
+		&& skipped_in_ == std::string( 5, 'n' ) && ids_.size() == 10
+		&& ser_in.get().good()
+		&& size_ <= sizeof( size_t ) + 7 + 4 * 4 + 3 * 6 + 193 * 2 ) {
+		
+		std::cout << "test_dedup: OK!" << std::endl;
+	} else {
+		std::cout << "test_dedup: error!" << std::endl;
+	}
+}
+void test_columns() {
+	auto columns_ = make_ntscolumns( &TestRow::id, &TestRow::price,
+									 &TestRow::name );
+	std::vector<TestRow> rows_out_;
+	for( unsigned int i = 0; i < 10; ++i )
+		rows_out_.push_back( { i, i * 1.5, std::string( i, 'n' ) } );
+	NTSerialize ser_out( console_mtx );
+	ser_out.write_columns( rows_out_, columns_ );
+	ser_out << 99u;
+	ser_out.write_columns( rows_out_, columns_ );
+	ser_out.save( "test_columns.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in.load( "test_columns.bin" );
+	std::vector<TestRow> rows_in_;
+	std::vector<double> prices_;
+	unsigned int val_in_ = 0;
+	ser_in.read_columns( rows_in_, columns_ );
+	ser_in >> val_in_;
+	ser_in.read_column<1>( prices_, columns_ );
+	
+	bool prices_ok_ = prices_.size() == rows_out_.size();
+	for( size_t i = 0; prices_ok_ && i < prices_.size(); ++i )
+		prices_ok_ = prices_[i] == rows_out_[i].price;
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( rows_in_ == rows_out_ && val_in_ == 99 && prices_ok_
+		&& ser_in.get().good() ) {
+		
+		std::cout << "test_columns: OK!" << std::endl;
+	} else {
+		std::cout << "test_columns: error!" << std::endl;
+	}
+}
+void test_packkeys() {
+	std::set<uint64_t> set_out_;
+	for( uint64_t i = 0; i < 10000; ++i )
+		set_out_.insert( 1000000000000ull + i * 3 + ( i % 7 == 0 ) );
+	std::map<int32_t, std::string> map_out_;
+	for( int32_t i = -300; i < 300; i += 2 )
+		map_out_.emplace( i * 1000, std::to_string( i ) );
+	std::multiset<uint16_t> mset_out_{ 1, 1, 1, 5, 65535, 65535 };
+	NTSerialize ser_out( console_mtx );
+	ser_out << ntsdirective::packkeys;
+	ser_out << set_out_;
+	size_t size_ = ser_out.size();
+	ser_out << map_out_ << mset_out_ << set_out_ << 7u;
+	ser_out.save( "test_packkeys.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in << ntsdirective::packkeys;
+	ser_in.load( "test_packkeys.bin" );
+	std::set<uint64_t> set_in_;
+	std::map<int32_t, std::string> map_in_;
+	std::multiset<uint16_t> mset_in_;
+	unsigned int val_in_ = 0;
+	ser_in >> set_in_ >> map_in_ >> mset_in_;
+	ser_in.skip<std::set<uint64_t>>() >> val_in_;
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( set_in_ == set_out_ && map_in_ == map_out_
+		&& mset_in_ == mset_out_ && val_in_ == 7
+		&& size_ * 4 < sizeof( size_t ) + set_out_.size() * 8 ) {
+		
+		std::cout << "test_packkeys: OK!" << std::endl;
+	} else {
+		std::cout << "test_packkeys: error!" << std::endl;
+	}
+}
+void test_floatxor() {
+	std::vector<double> vec_out_;
+	double value_ = 100.0;
+	for( unsigned int i = 0; i < 1000; ++i ) {
+		value_ += ( i % 10 == 0 ) ? 0.25 : 0.0;
+		vec_out_.push_back( value_ );
+	}
+	uint64_t nan_bits_ = 0x7ff8dead0000beefull;
+	double nan_;
+	std::memcpy( &nan_, &nan_bits_, sizeof( nan_ ) );
+	vec_out_.push_back( nan_ );
+	vec_out_.push_back( -0.0 );
+	vec_out_.push_back( std::numeric_limits<double>::infinity() );
+	vec_out_.push_back( std::numeric_limits<double>::denorm_min() );
+	std::deque<float> deque_out_;
+	for( unsigned int i = 0; i < 500; ++i )
+		deque_out_.push_back( std::sin( i * 0.01f ) );
+	NTSerialize ser_out( console_mtx );
+	ser_out << ntsdirective::floatxor;
+	ser_out << vec_out_;
+	size_t size_ = ser_out.size();
+	ser_out << deque_out_ << vec_out_ << 3u;
+	ser_out.save( "test_floatxor.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in << ntsdirective::floatxor;
+	ser_in.load( "test_floatxor.bin" );
+	std::vector<double> vec_in_;
+	std::deque<float> deque_in_;
+	unsigned int val_in_ = 0;
+	ser_in >> vec_in_ >> deque_in_;
+	ser_in.skip<std::vector<double>>() >> val_in_;
+	
+	bool exact_ = vec_in_.size() == vec_out_.size()
+				  && deque_in_.size() == deque_out_.size();
+	for( size_t i = 0; exact_ && i < vec_out_.size(); ++i )
+		exact_ = std::memcmp( &vec_in_[i], &vec_out_[i],
+							  sizeof( double ) ) == 0;
+	for( size_t i = 0; exact_ && i < deque_out_.size(); ++i )
+		exact_ = std::memcmp( &deque_in_[i], &deque_out_[i],
+							  sizeof( float ) ) == 0;
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( exact_ && val_in_ == 3
+		&& size_ * 10 < vec_out_.size() * sizeof( double ) ) {
+		
+		std::cout << "test_floatxor: OK!" << std::endl;
+	} else {
+		std::cout << "test_floatxor: error!" << std::endl;
+	}
+}
+
+void test_rle() {
+	std::vector<int32_t> vec_out_( 100000, 0 );
+	for( size_t i = 0; i < vec_out_.size(); i += 5000 )
+		vec_out_[i] = static_cast<int32_t>( i );
+	std::array<uint16_t, 300> arr_out_;
+	arr_out_.fill( 7 );
+	arr_out_[150] = 8;
+	std::vector<int32_t> noise_out_;
+	for( int32_t i = 0; i < 1000; ++i )
+		noise_out_.push_back( i * 7919 );
+	NTSerialize ser_out( console_mtx );
+	ser_out << ntsdirective::rle;
+	ser_out << vec_out_;
+	size_t size_ = ser_out.size();
+	// vector<bool> is written element by element, without a mode byte
+	std::vector<bool> bits_out_( 40, false );
+	bits_out_[3] = true;
+	ser_out << arr_out_ << noise_out_ << arr_out_ << bits_out_ << 5u;
+	ser_out.save( "test_rle.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in << ntsdirective::rle;
+	ser_in.load( "test_rle.bin" );
+	std::vector<int32_t> vec_in_;
+	std::array<uint16_t, 300> arr_in_;
+	std::vector<int32_t> noise_in_;
+	unsigned int val_in_ = 0;
+	ser_in >> vec_in_ >> arr_in_ >> noise_in_;
+	ser_in.skip<std::array<uint16_t, 300>>()
+		  .skip<std::vector<bool>>() >> val_in_;
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( vec_in_ == vec_out_ && arr_in_ == arr_out_
+		&& noise_in_ == noise_out_ && val_in_ == 5
+		&& size_ * 100 < vec_out_.size() * sizeof( int32_t ) ) {
+		
+		std::cout << "test_rle: OK!" << std::endl;
+	} else {
+		std::cout << "test_rle: error!" << std::endl;
+	}
+}
+
+void test_queue() {
+	std::queue<std::string> queue_out_;
+	queue_out_.push( "first" );
+	queue_out_.push( "second" );
+	queue_out_.push( "third" );
+	std::stack<int, std::vector<int>> stack_out_;
+	for( int i = 0; i < 1000; ++i )
+		stack_out_.push( i );
+	const std::queue<std::string>& queue_const_ = queue_out_;
+	const std::stack<int, std::vector<int>>& stack_const_ = stack_out_;
+	NTSerialize ser_out( console_mtx );
+	ser_out << queue_const_ << stack_const_;
+	ser_out.save( "test_queue.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in.load( "test_queue.bin" );
+	std::queue<std::string> queue_in_;
+	std::stack<int, std::vector<int>> stack_in_;
+	ser_in >> queue_in_ >> stack_in_;
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( queue_out_.size() == 3 && queue_in_ == queue_out_
+		&& stack_out_.size() == 1000 && stack_in_ == stack_out_
+		&& stack_in_.top() == 999 ) {
+		
+		std::cout << "test_queue: OK!" << std::endl;
+	} else {
+		std::cout << "test_queue: error!" << std::endl;
+	}
+}
+void test_priority_queue() {
+	std::priority_queue<int, std::vector<int>, std::greater<int>> pq_out_;
+	for( int i = 0; i < 1000; ++i )
+		pq_out_.push( ( i * 7919 ) % 1009 );
+	// The old format wrote the elements in popping order
+	std::priority_queue<int> sorted_;
+	for( int i = 0; i < 10; ++i )
+		sorted_.push( i );
+	NTSerialize ser_out( console_mtx );
+	ser_out << pq_out_;
+	size_t size_ = sorted_.size();
+	ser_out << size_;
+	for( int i = 9; i >= 0; --i )
+		ser_out << i;
+	ser_out.save( "test_priority_queue.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in.load( "test_priority_queue.bin" );
+	std::priority_queue<int, std::vector<int>, std::greater<int>> pq_in_;
+	std::priority_queue<int> sorted_in_;
+	ser_in >> pq_in_ >> sorted_in_;
+	
+	bool equal_ = pq_in_.size() == pq_out_.size()
+				  && sorted_in_.size() == sorted_.size();
+	while( equal_ && !pq_out_.empty() ) {
+		equal_ = pq_in_.top() == pq_out_.top();
+		pq_in_.pop();
+		pq_out_.pop();
+	}
+	while( equal_ && !sorted_.empty() ) {
+		equal_ = sorted_in_.top() == sorted_.top();
+		sorted_in_.pop();
+		sorted_.pop();
+	}
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( equal_ ) {
+		std::cout << "test_priority_queue: OK!" << std::endl;
+	} else {
+		std::cout << "test_priority_queue: error!" << std::endl;
+	}
+}
+
+void test_pointers() {
+	typedef std::shared_ptr<std::vector<int>> shared_;
+	shared_ big_ = std::make_shared<std::vector<int>>( 10000, 1 );
+	shared_ small_ = std::make_shared<std::vector<int>>( 3, 2 );
+	std::vector<shared_> vec_out_;
+	for( unsigned int i = 0; i < 1000; ++i )
+		vec_out_.push_back( i % 3 == 0 ? big_
+							: i % 3 == 1 ? small_ : nullptr );
+	std::unique_ptr<std::string> unique_out_( new std::string( "owned" ) );
+	std::unique_ptr<std::string> empty_out_;
+	NTSerialize ser_out( console_mtx );
+	ser_out << vec_out_;
+	size_t size_ = ser_out.size();
+	ser_out << unique_out_ << empty_out_ << small_ << big_;
+	ser_out.save( "test_pointers.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in.load( "test_pointers.bin" );
+	std::vector<shared_> vec_in_;
+	std::unique_ptr<std::string> unique_in_;
+	std::unique_ptr<std::string> empty_in_( new std::string( "x" ) );
+	shared_ big_in_;
+	ser_in >> vec_in_ >> unique_in_ >> empty_in_;
+	ser_in.skip<shared_>() >> big_in_;
+
+	// An aliased member shares the address of its owner, but not its
+	// type; an id read back as another type is corrupt.
+	typedef std::pair<int, int> owner_t;
+	std::shared_ptr<owner_t> owner_ = std::make_shared<owner_t>( 4, 5 );
+	std::shared_ptr<int> member_( owner_, &owner_->first );
+	NTSerialize ser_alias( console_mtx );
+	ser_alias << owner_ << member_ << member_;
+	std::shared_ptr<owner_t> owner_in_;
+	std::shared_ptr<int> member_in_;
+	std::shared_ptr<double> wrong_in_;
+	ser_alias << ntsdirective::posstart >> owner_in_ >> member_in_;
+	bool alias_ok_ = ser_alias.get().good() && owner_in_ && member_in_
+					 && owner_in_->second == 5 && *member_in_ == 4;
+	ser_alias >> wrong_in_;
+	alias_ok_ = alias_ok_ && !wrong_in_
+				&& ser_alias.error() == ntserror::corrupt;
+
+	bool shared_ok_ = vec_in_.size() == vec_out_.size();
+	for( size_t i = 0; shared_ok_ && i < vec_in_.size(); ++i ) {
+		shared_ok_ = vec_in_[i] == vec_in_[i % 3]
+					 && ( !vec_in_[i] ) == ( !vec_out_[i] );
+	}
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( shared_ok_ && alias_ok_ && *vec_in_[0] == *big_ && *vec_in_[1] == *small_
+		&& big_in_ == vec_in_[0]
+		&& unique_in_ && *unique_in_ == "owned" && !empty_in_
+		&& size_ < big_->size() * sizeof( int ) + 1000 * 8 + 1024 ) {
+		
+		std::cout << "test_pointers: OK!" << std::endl;
+	} else {
+		std::cout << "test_pointers: error!" << std::endl;
+	}
+}
+
+void test_frame_decoder() {
+	int fds_[2];
+	if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds_ ) != 0 ) {
+		std::lock_guard<std::mutex> lck_( console_mtx );
+		std::cout << "test_frame_decoder: error!" << std::endl;
+		return;
+	}
+	fcntl( fds_[0], F_SETFL, fcntl( fds_[0], F_GETFL ) | O_NONBLOCK );
+	const unsigned int count_ = 200;
+	// Frames go out in odd-sized pieces, splitting headers too
+	std::thread writer_( [&fds_, count_]() {
+		NTSerialize ser_out( console_mtx );
+		std::string frames_;
+		for( unsigned int i = 0; i < count_; ++i ) {
+			std::vector<unsigned int> vec_( i % 50 == 0 ? 50000 : i, i );
+			ser_out << ntsdirective::clear << i << vec_;
+			size_t size_ = ser_out.size();
+			frames_.append( reinterpret_cast<const char*>( &size_ ),
+							sizeof( size_t ) );
+			frames_.append( ser_out.get().str() );
+		}
+		for( size_t pos_ = 0; pos_ < frames_.size(); pos_ += 4093 ) {
+			size_t size_ = std::min<size_t>( 4093, frames_.size() - pos_ );
+			if( write( fds_[1], frames_.data() + pos_, size_ )
+				!= static_cast<ssize_t>( size_ ) ) {
+				break;
+			}
+		}
+		close( fds_[1] );
+	} );
+	
+	NTSFrameDecoder decoder_;
+	NTSerialize ser_in( console_mtx );
+	unsigned int next_ = 0;
+	bool ordered_ = true;
+	bool capped_ = true;
+	for( ;; ) {
+		pollfd pfd_{ fds_[0], POLLIN, 0 };
+		poll( &pfd_, 1, 1000 );
+		ssize_t read_ = decoder_.feed( fds_[0] );
+		capped_ = capped_ && read_ <= static_cast<ssize_t>(
+											NTSFrameDecoder::read_chunk );
+		while( decoder_.next( ser_in ) ) {
+			unsigned int id_ = 0;
+			std::vector<unsigned int> vec_;
+			ser_in >> id_ >> vec_;
+			ordered_ = ordered_ && ser_in.get().good() && id_ == next_++
+					   && vec_.size() == ( id_ % 50 == 0 ? 50000 : id_ );
+		}
+		if( read_ == 0 || ( read_ < 0 && errno != EAGAIN ) )
+			break;
+	}
+	writer_.join();
+	close( fds_[0] );
+	
+	// A smaller cap leaves the rest in the socket
+	NTSFrameDecoder small_;
+	std::string data_( 5000, 'd' );
+	if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds_ ) == 0 ) {
+		capped_ = capped_ && write( fds_[1], data_.data(), data_.size() )
+							 == static_cast<ssize_t>( data_.size() )
+				  && small_.feed( fds_[0], 1000 ) == 1000
+				  && small_.pending() == 1000;
+		close( fds_[0] );
+		close( fds_[1] );
+	} else {
+		capped_ = false;
+	}
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( ordered_ && capped_ && next_ == count_
+		&& decoder_.count() == count_
+		&& decoder_.pending() == 0 && !decoder_.failed() ) {
+		
+		std::cout << "test_frame_decoder: OK!" << std::endl;
+	} else {
+		std::cout << "test_frame_decoder: error!" << std::endl;
+	}
+}
+
+void test_limits() {
+	// A length prefix that is far larger than the data
+	NTSerialize ser_len( console_mtx );
+	ser_len << ( static_cast<size_t>( 1 ) << 40 ) << 1 << 2 << 3;
+	std::vector<int> vec_;
+	ser_len >> vec_;
+	bool truncated_ = ser_len.get().fail() && vec_.empty()
+					  && ser_len.error() == ntserror::truncated;
+	// Also for types with their own operator>>
+	NTSerialize ser_user( console_mtx );
+	ser_user << ( static_cast<size_t>( 1 ) << 34 );
+	std::vector<TestStruct2> user_;
+	ser_user >> user_;
+	truncated_ = truncated_ && user_.empty()
+				 && ser_user.error() == ntserror::truncated;
+	// And for raw sequences in rle mode
+	NTSerialize ser_rle( console_mtx );
+	ser_rle << ntsdirective::rle << ( static_cast<size_t>( 1 ) << 34 );
+	ser_rle >> vec_;
+	truncated_ = truncated_ && vec_.empty()
+				 && ser_rle.error() == ntserror::truncated;
+	// A corrupted count over real runs fails before it is allocated
+	NTSerialize ser_runs( console_mtx );
+	ser_runs << ntsdirective::rle << std::vector<int>( 1000, 7 );
+	ser_runs << ntsdirective::posstart
+			 << static_cast<size_t>( 0x80000000fa0ull );
+	ser_runs >> vec_;
+	truncated_ = truncated_ && vec_.empty()
+				 && ser_runs.error() == ntserror::corrupt;
+	// Skipped counts can't wrap around to a small offset
+	NTSerialize ser_wrap( console_mtx );
+	ser_wrap << ( ( static_cast<size_t>( 1 ) << 61 ) + 1 ) << 1ull << 2ull;
+	ser_wrap.skip<std::vector<uint64_t>>();
+	truncated_ = truncated_ && ser_wrap.error() == ntserror::truncated;
+	NTSerialize ser_wrap_rle( console_mtx );
+	ser_wrap_rle << ntsdirective::rle << std::vector<int>( 1000, 7 );
+	ser_wrap_rle << ntsdirective::posstart << static_cast<size_t>( -1 )
+				 << static_cast<unsigned char>( 1 )
+				 << ( ( static_cast<size_t>( 1 ) << 62 ) + 1 );
+	ser_wrap_rle.skip<std::vector<int>>();
+	truncated_ = truncated_
+				 && ser_wrap_rle.error() == ntserror::truncated;
+	// Bytes other than 0 and 1 are never loaded as bools
+	NTSerialize ser_bool( console_mtx );
+	ser_bool << static_cast<size_t>( 2 ) << static_cast<unsigned char>( 1 )
+			 << static_cast<unsigned char>( 5 );
+	std::vector<bool> bools_;
+	ser_bool >> bools_;
+	bool flags_ = ser_bool.error() == ntserror::corrupt;
+	NTSerialize ser_flag( console_mtx );
+	ser_flag << static_cast<unsigned char>( 7 ) << 1;
+	std::unique_ptr<int> flag_ptr_;
+	ser_flag >> flag_ptr_;
+	flags_ = flags_ && !flag_ptr_ && ser_flag.error() == ntserror::corrupt;
+	NTSerialize ser_array( console_mtx );
+	ser_array << static_cast<uint32_t>( 0x01000300 );
+	std::array<bool, 4> array_;
+	ser_array >> array_;
+	flags_ = flags_ && ser_array.error() == ntserror::corrupt
+			 && !array_[0] && !array_[1];
+	
+	std::map<std::string, std::vector<int>> map_out_;
+	map_out_["small"] = std::vector<int>( 10, 1 );
+	map_out_["large"] = std::vector<int>( 100, 2 );
+	NTSerialize ser_out( console_mtx );
+	ser_out << map_out_;
+	ser_out.save( "test_limits.bin" );
+	
+	ntslimits limits_;
+	limits_.max_elements = 50;
+	NTSerialize ser_elements( console_mtx );
+	ser_elements.limits( limits_ ).load( "test_limits.bin" );
+	std::map<std::string, std::vector<int>> map_in_;
+	ser_elements >> map_in_;
+	bool elements_ = ser_elements.get().fail()
+					 && ser_elements.error() == ntserror::elements;
+	
+	limits_ = ntslimits();
+	limits_.max_bytes = 200;
+	NTSerialize ser_bytes( console_mtx );
+	ser_bytes.limits( limits_ ).load( "test_limits.bin" );
+	map_in_.clear();
+	ser_bytes >> map_in_;
+	bool bytes_ = ser_bytes.error() == ntserror::bytes;
+	
+	limits_ = ntslimits();
+	limits_.max_depth = 1;
+	NTSerialize ser_depth( console_mtx );
+	ser_depth.limits( limits_ ).load( "test_limits.bin" );
+	map_in_.clear();
+	ser_depth >> map_in_;
+	bool depth_ = ser_depth.error() == ntserror::depth;
+	ser_depth.clear();
+	// Pointers count as nesting too
+	std::unique_ptr<std::unique_ptr<std::unique_ptr<int>>> ptr_(
+		new std::unique_ptr<std::unique_ptr<int>>(
+			new std::unique_ptr<int>( new int( 1 ) ) ) );
+	NTSerialize ser_ptr( console_mtx );
+	ser_ptr << ptr_;
+	bool written_ = ser_ptr.get().good();
+	limits_.max_depth = 2;
+	ser_ptr.limits( limits_ ) >> ptr_;
+	depth_ = depth_ && written_ && ser_ptr.error() == ntserror::depth;
+	
+	// Within the limits everything decodes
+	limits_.max_depth = 2;
+	NTSerialize ser_in( console_mtx );
+	ser_in.limits( limits_ ).load( "test_limits.bin" );
+	map_in_.clear();
+	ser_in >> map_in_;
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( truncated_ && flags_ && elements_ && bytes_ && depth_
+		&& ser_depth.error() == ntserror::none
+		&& map_in_ == map_out_ && ser_in.error() == ntserror::none ) {
+		
+		std::cout << "test_limits: OK!" << std::endl;
+	} else {
+		std::cout << "test_limits: error!" << std::endl;
+	}
+}
+
+void test_ring() {
+	NTSRing ring_;
+	// Small enough to wrap around many times
+	if( !ring_.anonymous( 4096 ) ) {
+		std::lock_guard<std::mutex> lck_( console_mtx );
+		std::cout << "test_ring: error!" << std::endl;
+		return;
+	}
+	const unsigned int count_ = 2000;
+	pid_t pid_ = fork();
+	if( pid_ == 0 ) {
+		NTSerialize ser_out( console_mtx );
+		for( unsigned int i = 0; i < count_; ++i ) {
+			if( !ring_.begin( ser_out, 512 ) )
+				_exit( EXIT_FAILURE );
+			ser_out << i << std::string( i % 300, 'x' );
+			if( !ring_.commit( ser_out ) )
+				_exit( EXIT_FAILURE );
+		}
+		unsigned int last_ = count_;
+		ring_.send( reinterpret_cast<const char*>( &last_ ),
+					sizeof( last_ ) );
+		_exit( EXIT_SUCCESS );
+	}
+	
+	NTSerialize ser_in( console_mtx );
+	bool ordered_ = pid_ > 0;
+	unsigned int received_ = 0;
+	while( ordered_ && received_ <= count_
+		   && ring_.receive( ser_in, 5000 ) ) {
+		unsigned int id_ = 0;
+		ser_in >> id_;
+		if( id_ < count_ ) {
+			std::string str_;
+			ser_in >> str_;
+			ordered_ = str_ == std::string( id_ % 300, 'x' );
+		}
+		ordered_ = ordered_ && ser_in.get().good() && id_ == received_++;
+		ring_.release( ser_in );
+	}
+	int status_ = EXIT_FAILURE;
+	if( pid_ > 0 )
+		waitpid( pid_, &status_, 0 );
+	
+	// A record larger than reserved fails without being published
+	NTSRing small_;
+	small_.anonymous( 256 );
+	NTSerialize ser_big( console_mtx );
+	small_.begin( ser_big, 16 );
+	ser_big << std::string( 100, 'y' );
+	bool overflow_ = !small_.commit( ser_big ) && !ser_big.attached()
+					 && !small_.receive( ser_in, 0 );
+	
+	// A length running past the ring is corrupt, not a record
+	const char* name_ = "/nts_test_ring";
+	NTSRing named_;
+	bool corrupt_ = named_.create( name_, 256 );
+	const uint64_t payload_ = 0x4e5453636f727275ull;
+	corrupt_ = corrupt_ && named_.send(
+		reinterpret_cast<const char*>( &payload_ ), sizeof( payload_ ) );
+	int fd_ = shm_open( name_, O_RDWR, 0600 );
+	struct stat stat_;
+	char* map_ = nullptr;
+	if( fd_ >= 0 && fstat( fd_, &stat_ ) == 0 ) {
+		void* mem_ = mmap( nullptr, static_cast<size_t>( stat_.st_size ),
+						   PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0 );
+		map_ = mem_ == MAP_FAILED ? nullptr : static_cast<char*>( mem_ );
+	}
+	bool patched_ = false;
+	for( size_t i = 0; map_ != nullptr && !patched_
+		 && i + 16 <= static_cast<size_t>( stat_.st_size ); i += 8 ) {
+		size_t size_ = 0;
+		std::memcpy( &size_, map_ + i, sizeof( size_ ) );
+		if( size_ == sizeof( payload_ )
+			&& std::memcmp( map_ + i + 8, &payload_, 8 ) == 0 ) {
+			size_ = 1 << 20;
+			std::memcpy( map_ + i, &size_, sizeof( size_ ) );
+			patched_ = true;
+		}
+	}
+	corrupt_ = corrupt_ && patched_ && !named_.receive( ser_in, 0 )
+			   && named_.failed() && !ser_in.attached();
+	// A capacity that isn't a power of two is refused
+	size_t capacity_ = 100;
+	if( map_ != nullptr )
+		std::memcpy( map_ + sizeof( uint64_t ), &capacity_, 8 );
+	NTSRing reopened_;
+	corrupt_ = corrupt_ && !reopened_.open( name_ );
+	if( map_ != nullptr )
+		munmap( map_, static_cast<size_t>( stat_.st_size ) );
+	if( fd_ >= 0 )
+		close( fd_ );
+	NTSRing::unlink( name_ );
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( ordered_ && received_ == count_ + 1 && WIFEXITED( status_ )
+		&& WEXITSTATUS( status_ ) == EXIT_SUCCESS && overflow_
+		&& corrupt_ ) {
+		
+		std::cout << "test_ring: OK!" << std::endl;
+	} else {
+		std::cout << "test_ring: error!" << std::endl;
+	}
+}
+
+void test_snapshot() {
+	std::vector<int> state_( 1 << 20 );
+	for( size_t i = 0; i < state_.size(); ++i )
+		state_[i] = static_cast<int>( i );
+	const std::vector<int> image_ = state_;
+	NTSSnapshot snapshot_( console_mtx );
+	bool started_ = snapshot_.start( "test_snapshot.bin",
+		[&state_]( NTSerialize& nts ) {
+			nts << state_;
+		} );
+	// The parent keeps mutating, the snapshot keeps the forked image
+	for( size_t i = 0; i < state_.size(); ++i )
+		state_[i] = -1;
+	snapshot_.cow_bytes();
+	bool ok_ = snapshot_.wait();
+	size_t size_ = snapshot_.size();
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in.load( "test_snapshot.bin" );
+	std::vector<int> state_in_;
+	ser_in >> state_in_;
+	
+	// A throwing fn still ends the child and leaves no file behind
+	std::remove( "test_snapshot_throw.bin" );
+	bool thrown_ = snapshot_.start( "test_snapshot_throw.bin",
+		[]( NTSerialize& nts ) {
+			nts << 1;
+			throw std::runtime_error( "snapshot" );
+		} );
+	thrown_ = thrown_ && !snapshot_.wait()
+			  && !std::ifstream( "test_snapshot_throw.bin" )
+			  && !std::ifstream( "test_snapshot_throw.bin.tmp" );
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( started_ && ok_ && thrown_ && !snapshot_.running()
+		&& state_in_ == image_
+		&& size_ == sizeof( size_t ) + image_.size() * 4 ) {
+		
+		std::cout << "test_snapshot: OK!" << std::endl;
+	} else {
+		std::cout << "test_snapshot: error!" << std::endl;
+	}
+}
+
+void test_image() {
+	// Sections at known offsets, one per thread
+	const unsigned int sections_ = 4;
+	NTSerialize ser_out( console_mtx );
+	std::vector<size_t> offsets_;
+	for( unsigned int i = 0; i < sections_; ++i ) {
+		offsets_.push_back( ser_out.size() );
+		std::map<unsigned int, std::string> map_;
+		for( unsigned int k = 0; k < 1000; ++k )
+			map_[k * sections_ + i] = std::to_string( k );
+		ser_out << map_;
+	}
+	ser_out.save( "test_image.bin" );
+	
+	ntsimage frozen_ = ser_out.image();
+	ntsimage loaded_;
+	ntsimage mapped_;
+	bool opened_ = loaded_.load( "test_image.bin" )
+				   && mapped_.map( "test_image.bin" )
+				   && mapped_.size() == frozen_.size();
+	std::atomic<unsigned int> decoded_{0};
+	std::vector<std::thread> threads_;
+	for( const ntsimage* image_ : { &frozen_, &loaded_, &mapped_ } ) {
+		for( unsigned int i = 0; i < sections_; ++i ) {
+			threads_.emplace_back( [image_, i, &offsets_, &decoded_]() {
+				NTSerialize cursor_( console_mtx, *image_, offsets_[i] );
+				std::map<unsigned int, std::string> map_;
+				cursor_ >> map_;
+				if( cursor_.get().good() && map_.size() == 1000
+					&& map_[999 * sections_ + i] == "999" ) {
+					++decoded_;
+				}
+			} );
+		}
+	}
+	for( auto& thread_ : threads_ )
+		thread_.join();
+	// Cursors don't write into the image
+	NTSerialize cursor_( console_mtx, frozen_ );
+	cursor_ << 1u;
+	// Images hold what was written, attached or referenced
+	std::string text_( NTSerialize::zerocopy_threshold, 'i' );
+	std::vector<char> memory_( 64 );
+	ntsmembuf buffer_( memory_.data(), memory_.size(), 0 );
+	NTSerialize writer_( console_mtx );
+	writer_.attach( buffer_ ) << 1u << 2u;
+	bool written_ = writer_.image().size() == 2 * sizeof( unsigned int );
+	writer_.detach() << ntsdirective::zerocopy << text_;
+	ntsimage referenced_ = writer_.image();
+	std::string text_in_;
+	NTSerialize( console_mtx, referenced_ ) >> text_in_;
+	written_ = written_ && text_in_ == text_;
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( opened_ && decoded_ == 3 * sections_ && cursor_.get().fail()
+		&& written_ ) {
+		std::cout << "test_image: OK!" << std::endl;
+	} else {
+		std::cout << "test_image: error!" << std::endl;
+	}
+}
+
+void test_flat() {
+	std::vector<std::vector<int>> rows_out_;
+	for( int i = 0; i < 100; ++i )
+		rows_out_.push_back( std::vector<int>( i % 7, i ) );
+	std::vector<std::string> words_out_ = { "flat", "", "offsets" };
+	std::map<int, std::vector<double>> map_out_ = {
+		{ 1, { 0.5, 1.5 } }, { 2, {} }, { 3, { 2.5 } } };
+	std::unordered_map<std::string, std::string> names_out_ = {
+		{ "a", "alpha" }, { "b", "" } };
+	NTSerialize ser_out( console_mtx );
+	ser_out << ntsdirective::flat;
+	ser_out << rows_out_ << words_out_ << map_out_ << names_out_;
+	ser_out << rows_out_ << words_out_ << 5u;
+	ser_out.save( "test_flat.bin" );
+	
+	NTSerialize ser_in( console_mtx );
+	ser_in << ntsdirective::flat;
+	ser_in.load( "test_flat.bin" );
+	std::vector<std::vector<int>> rows_in_;
+	std::vector<std::string> words_in_;
+	std::map<int, std::vector<double>> map_in_;
+	std::unordered_map<std::string, std::string> names_in_;
+	ntsflat<int> flat_in_;
+	unsigned int val_in_ = 0;
+	ser_in >> rows_in_ >> words_in_ >> map_in_ >> names_in_ >> flat_in_;
+	ser_in.skip<std::vector<std::string>>() >> val_in_;
+	
+	ntsflat<int> flat_out_;
+	for( const auto& row_ : rows_out_ )
+		flat_out_.push_back( row_ );
+	bool flat_ok_ = flat_in_.size() == rows_out_.size();
+	for( size_t i = 0; flat_ok_ && i < flat_in_.size(); ++i )
+		flat_ok_ = std::equal( flat_in_.begin( i ), flat_in_.end( i ),
+							   rows_out_[i].begin(), rows_out_[i].end() );
+	ser_in << ntsdirective::clear << flat_out_;
+	ser_in << ntsdirective::posstart >> rows_in_;
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( rows_in_ == rows_out_ && words_in_ == words_out_
+		&& map_in_ == map_out_ && names_in_ == names_out_
+		&& flat_ok_ && val_in_ == 5 && ser_in.get().good() ) {
+		
+		std::cout << "test_flat: OK!" << std::endl;
+	} else {
+		std::cout << "test_flat: error!" << std::endl;
+	}
+}
+
+void test_prefetch() {
+	std::vector<uint32_t> vec_out_( 100000 );
+	for( size_t i = 0; i < vec_out_.size(); ++i )
+		vec_out_[i] = static_cast<uint32_t>( i * 2654435761u );
+	std::map<std::string, std::vector<int>> map_out_;
+	for( int i = 0; i < 500; ++i )
+		map_out_["key" + std::to_string( i )] = std::vector<int>( i, i );
+	NTSerialize ser_out( console_mtx );
+	ser_out << vec_out_ << map_out_ << vec_out_ << 5u;
+	ser_out.save( "test_prefetch.bin" );
+	
+	// Small chunks, so values keep crossing them
+	ntsprefetchbuf file_;
+	bool open_ = file_.open( "test_prefetch.bin", 4096, 3 );
+	ntslimits limits_;
+	limits_.max_elements = 1 << 20;
+	NTSerialize ser_in( console_mtx );
+	ser_in.limits( limits_ ).attach( file_ );
+	std::vector<uint32_t> vec_in_;
+	std::map<std::string, std::vector<int>> map_in_;
+	unsigned int val_in_ = 0;
+	ser_in >> vec_in_ >> map_in_;
+	ser_in.skip<std::vector<uint32_t>>() >> val_in_;
+	bool end_ = file_.remaining() == 0 && file_.ok();
+	ser_in.detach();
+	// Reading a buffer that isn't open ends at once
+	ntsprefetchbuf missing_;
+	bool closed_ = !missing_.open( "test_prefetch_missing.bin" );
+	NTSerialize ser_missing( console_mtx );
+	std::vector<uint32_t> none_;
+	ser_missing.attach( missing_ ) >> none_;
+	closed_ = closed_ && ser_missing.error() == ntserror::truncated;
+	file_.close();
+	ser_missing.clear();
+	ser_missing.attach( file_ ) >> none_;
+	closed_ = closed_ && ser_missing.error() == ntserror::truncated
+			  && none_.empty();
+	ser_missing.detach();
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( open_ && vec_in_ == vec_out_ && map_in_ == map_out_
+		&& val_in_ == 5 && end_ && ser_in.error() == ntserror::none
+		&& closed_ ) {
+		
+		std::cout << "test_prefetch: OK!" << std::endl;
+	} else {
+		std::cout << "test_prefetch: error!" << std::endl;
+	}
+}
+
+void test_hugebuf() {
+	std::vector<uint64_t> vec_out_( 1 << 20 );
+	for( size_t i = 0; i < vec_out_.size(); ++i )
+		vec_out_[i] = i * i;
+	std::vector<std::string> str_out_( 10000, "huge pages" );
+	ntshugebuf buffer_;
+	bool reserved_ = buffer_.reserve( 64 << 20, ntspages::transparent,
+									  ntsplacement::interleave );
+	NTSerialize ser( console_mtx );
+	ser.attach( buffer_ );
+	ser << str_out_;
+	const char* data_ = buffer_.data();
+	ser << vec_out_ << 5u;
+	// The data grew in place
+	bool grown_ = buffer_.data() == data_ && buffer_.capacity() >= 8 << 20
+				  && buffer_.size() == ser.size();
+	std::vector<std::string> str_in_;
+	std::vector<uint64_t> vec_in_;
+	unsigned int val_in_ = 0;
+	ser >> str_in_ >> vec_in_ >> val_in_;
+	bool read_ = ser.get().good();
+	// Nothing is mapped past the reservation
+	ser << vec_out_ << vec_out_ << vec_out_ << vec_out_ << vec_out_
+		<< vec_out_ << vec_out_ << vec_out_;
+	bool full_ = ser.get().bad() && buffer_.capacity() == 64 << 20;
+	ser.detach();
+	
+	std::lock_guard<std::mutex> lck_( console_mtx );
+	if( reserved_ && grown_ && read_ && full_ && str_in_ == str_out_
+		&& vec_in_ == vec_out_ && val_in_ == 5 ) {
+		
+		std::cout << "test_hugebuf: OK!" << std::endl;
+	} else {
+		std::cout << "test_hugebuf: error!" << std::endl;
+	}
+}
 
 int main() {
 	test_easy();
@@ -256,6 +1461,28 @@ int main() {
 	test_set();
 	test_map();
 	test_unordered_multimap();
+	test_metrics();
+	test_concurrent_writer();
+	test_buffer_pool();
+	test_zerocopy();
+	test_skip();
+	test_lazy();
+	test_dedup();
+	test_columns();
+	test_packkeys();
+	test_floatxor();
+	test_rle();
+	test_queue();
+	test_priority_queue();
+	test_pointers();
+	test_frame_decoder();
+	test_limits();
+	test_ring();
+	test_snapshot();
+	test_image();
+	test_flat();
+	test_prefetch();
+	test_hugebuf();
 	return( EXIT_SUCCESS );
 }
 